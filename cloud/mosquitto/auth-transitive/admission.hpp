@@ -0,0 +1,139 @@
+
+#include <time.h>
+
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <map>
+
+/* ----------------------------------------------------------------------------
+* Admission control
+*
+* Caps the authentication work the broker does when many clients connect at
+* once, e.g., after a restart. Attempts are admitted by token buckets per IP
+* and per org and by a global budget per second. Clients that fail to
+* authenticate are rejected without any checks until their exponential backoff
+* has passed.
+*/
+
+/** A token bucket refilled at `rate` tokens per second, up to `burst` */
+struct TokenBucket {
+  double tokens;
+  time_t last;
+
+  /** Take a token if there is one */
+  bool take(double rate, double burst, time_t now) {
+    tokens = std::min(burst, tokens + (now - last) * rate);
+    last = now;
+    if (tokens < 1) return false;
+    tokens--;
+    return true;
+  }
+
+  /** Whether the bucket would be full by now, i.e., can be forgotten */
+  bool idle(double rate, double burst, time_t now) const {
+    return tokens + (now - last) * rate >= burst;
+  }
+};
+
+class Admission {
+
+public:
+  struct Config {
+    double ipRate = 5;          // attempts per second per IP
+    double ipBurst = 50;
+    double orgRate = 20;        // attempts per second per org
+    double orgBurst = 200;
+    double globalRate = 500;    // attempts per second overall
+    time_t backoffBase = 1;     // seconds after the first failure, doubling
+    time_t backoffMax = 300;
+  };
+
+  enum Decision { ADMITTED, IP_LIMITED, ORG_LIMITED, GLOBAL_LIMITED, BACKOFF };
+
+private:
+  struct Failures {
+    int count;
+    time_t retryAt;
+  };
+
+  Config config;
+  TokenBucket global;
+  std::map<std::string, TokenBucket, std::less<>> ips, orgs;
+  std::map<std::string, Failures, std::less<>> failures; // by client key
+
+  static bool take(std::map<std::string, TokenBucket, std::less<>> &buckets,
+    std::string_view key, double rate, double burst, time_t now) {
+
+    auto it = buckets.find(key);
+    if (it == buckets.end()) {
+      it = buckets.emplace(key, TokenBucket{burst, now}).first;
+    }
+    return it->second.take(rate, burst, now);
+  }
+
+public:
+
+  Admission() {
+    configure(Config());
+  }
+
+  void configure(const Config &config) {
+    this->config = config;
+    global = {config.globalRate, 0};
+  }
+
+  /** Whether to try authenticating the client with the given key (e.g., IP and
+  client id) connecting from ip. Cheap, to be checked before anything else. */
+  Decision admit(std::string_view client, std::string_view ip, time_t now) {
+    auto failed = failures.find(client);
+    if (failed != failures.end() && now < failed->second.retryAt) {
+      return BACKOFF;
+    }
+    if (!take(ips, ip, config.ipRate, config.ipBurst, now)) return IP_LIMITED;
+    if (!global.take(config.globalRate, config.globalRate, now)) {
+      return GLOBAL_LIMITED;
+    }
+    return ADMITTED;
+  }
+
+  /** Whether to continue authenticating a client of the given org */
+  Decision admitOrg(std::string_view org, time_t now) {
+    return take(orgs, org, config.orgRate, config.orgBurst, now) ?
+      ADMITTED : ORG_LIMITED;
+  }
+
+  /** Record the outcome of an authentication attempt whose credentials were
+  checked; attempts shed by the limits above are not failures */
+  void result(std::string_view client, bool success, time_t now) {
+    auto it = failures.find(client);
+    if (success) {
+      if (it != failures.end()) failures.erase(it);
+      return;
+    }
+    if (it == failures.end()) {
+      it = failures.emplace(client, Failures{0, 0}).first;
+    }
+    Failures &f = it->second;
+    f.count++;
+    f.retryAt = now + std::min(config.backoffBase << std::min(f.count - 1, 20),
+      config.backoffMax);
+  }
+
+  /** Forget idle buckets and failures whose backoff has long passed */
+  void prune(time_t now) {
+    std::erase_if(ips, [&](auto &e) {
+        return e.second.idle(config.ipRate, config.ipBurst, now);
+      });
+    std::erase_if(orgs, [&](auto &e) {
+        return e.second.idle(config.orgRate, config.orgBurst, now);
+      });
+    std::erase_if(failures, [&](auto &e) {
+        return e.second.retryAt + config.backoffMax < now;
+      });
+  }
+
+  size_t size() const {
+    return ips.size() + orgs.size() + failures.size();
+  }
+};
@@ -0,0 +1,116 @@
+
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+/* ----------------------------------------------------------------------------
+* Allocation counting
+*
+* Built with TRANSITIVE_COUNT_ALLOCS defined, global operator new is replaced by
+* one that counts the allocations and bytes of each thread, so that callbacks
+* can record what they allocate (COUNT_ALLOCS) and tests can assert that hot
+* paths don't allocate at all (countAllocs). Without it, nothing is counted and
+* COUNT_ALLOCS compiles to nothing. Include in one translation unit only.
+*/
+
+struct AllocCount {
+  uint64_t allocations = 0;
+  uint64_t bytes = 0;
+
+  AllocCount operator-(const AllocCount &other) const {
+    return {allocations - other.allocations, bytes - other.bytes};
+  }
+};
+
+/// Allocations made by this thread so far
+inline thread_local AllocCount allocCount;
+
+/** Allocations made by a callback in total */
+struct AllocStats {
+  uint64_t calls = 0;
+  uint64_t allocations = 0;
+  uint64_t bytes = 0;
+  uint64_t maxAllocations = 0; // most in a single call
+};
+
+/** Adds the allocations made during its lifetime to the given stats */
+class AllocScope {
+  AllocStats &stats;
+  AllocCount start;
+
+public:
+  AllocScope(AllocStats &stats) : stats(stats), start(allocCount) {}
+
+  ~AllocScope() {
+    AllocCount made = allocCount - start;
+    stats.calls++;
+    stats.allocations += made.allocations;
+    stats.bytes += made.bytes;
+    if (made.allocations > stats.maxAllocations) {
+      stats.maxAllocations = made.allocations;
+    }
+  }
+};
+
+/** The allocations fn makes on this thread, all zero when not counting */
+template<typename F> AllocCount countAllocs(F fn) {
+  AllocCount start = allocCount;
+  fn();
+  return allocCount - start;
+}
+
+#ifdef TRANSITIVE_COUNT_ALLOCS
+
+#define COUNT_ALLOCS(stats) AllocScope allocScope_(stats)
+const bool allocsCounted = true;
+
+void *operator new(size_t size) {
+  allocCount.allocations++;
+  allocCount.bytes += size;
+  if (void *p = std::malloc(size ? size : 1)) return p;
+  throw std::bad_alloc();
+}
+
+void *operator new[](size_t size) {
+  return operator new(size);
+}
+
+void *operator new(size_t size, std::align_val_t alignment) {
+  allocCount.allocations++;
+  allocCount.bytes += size;
+  size_t align = static_cast<size_t>(alignment);
+  // aligned_alloc wants a multiple of the alignment
+  if (void *p = std::aligned_alloc(align, (size + align - 1) / align * align)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+void *operator new[](size_t size, std::align_val_t alignment) {
+  return operator new(size, alignment);
+}
+
+// the replaced operator new does use malloc, which gcc can't tell
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete[](void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+void operator delete[](void *p, size_t) noexcept { std::free(p); }
+void operator delete(void *p, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void *p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void *p, size_t, std::align_val_t) noexcept {
+  std::free(p);
+}
+void operator delete[](void *p, size_t, std::align_val_t) noexcept {
+  std::free(p);
+}
+
+#else
+
+#define COUNT_ALLOCS(stats) (void)(stats)
+const bool allocsCounted = false;
+
+#endif
@@ -0,0 +1,126 @@
+
+#include <cstddef>
+#include <memory_resource>
+#include <new>
+
+/* ----------------------------------------------------------------------------
+* Arenas
+*
+* Memory owned by one connection: its containers allocate from free lists
+* carved out of chunks that are released in one step when the connection goes
+* away, and that have a hard budget, so a single client can't bloat the heap.
+* The budget applies to what the arena takes from the heap, whole chunks, not
+* just to what the containers ask for. Allocations beyond it throw
+* std::bad_alloc, before anything is changed, so the arena remains usable.
+*
+* Not thread-safe, like the connections that use them.
+*/
+
+class Arena : public std::pmr::memory_resource {
+
+  static constexpr size_t ALIGN = alignof(std::max_align_t);
+  static constexpr size_t CHUNK = 1024;
+  /** Larger blocks are taken from the heap one by one */
+  static constexpr size_t MAX_BLOCK = 256;
+
+  struct Free { Free *next; };
+  struct alignas(ALIGN) Chunk { Chunk *previous; };
+
+  std::pmr::memory_resource *upstream;
+  size_t budget;
+  size_t used = 0;
+  Chunk *chunks = nullptr;
+  char *next = nullptr;
+  char *end = nullptr;
+  Free *free[MAX_BLOCK / ALIGN] = {};
+
+  static size_t blockSize(size_t bytes) {
+    return (bytes + ALIGN - 1) / ALIGN * ALIGN;
+  }
+
+  void charge(size_t bytes) {
+    if (used + bytes > budget) {
+      throw std::bad_alloc();
+    }
+    used += bytes;
+  }
+
+  void *do_allocate(size_t bytes, size_t alignment) override {
+    size_t size = blockSize(bytes == 0 ? 1 : bytes);
+    if (size > MAX_BLOCK || alignment > ALIGN) {
+      charge(size);
+      try {
+        return upstream->allocate(size, alignment);
+      } catch (...) {
+        used -= size;
+        throw;
+      }
+    }
+
+    Free *&list = free[size / ALIGN - 1];
+    if (list) {
+      Free *block = list;
+      list = block->next;
+      return block;
+    }
+
+    if (next + size > end) {
+      charge(CHUNK);
+      Chunk *chunk;
+      try {
+        chunk = static_cast<Chunk *>(upstream->allocate(CHUNK, ALIGN));
+      } catch (...) {
+        used -= CHUNK;
+        throw;
+      }
+      chunk->previous = chunks;
+      chunks = chunk;
+      next = reinterpret_cast<char *>(chunk) + sizeof(Chunk);
+      end = reinterpret_cast<char *>(chunk) + CHUNK;
+    }
+    void *block = next;
+    next += size;
+    return block;
+  }
+
+  void do_deallocate(void *p, size_t bytes, size_t alignment) override {
+    size_t size = blockSize(bytes == 0 ? 1 : bytes);
+    if (size > MAX_BLOCK || alignment > ALIGN) {
+      upstream->deallocate(p, size, alignment);
+      used -= size;
+      return;
+    }
+
+    Free *&list = free[size / ALIGN - 1];
+    list = new (p) Free{list};
+  }
+
+  bool do_is_equal(const std::pmr::memory_resource &other) const
+    noexcept override {
+    return this == &other;
+  }
+
+public:
+
+  Arena(size_t budget,
+    std::pmr::memory_resource *upstream = std::pmr::get_default_resource()) :
+    upstream(upstream), budget(budget) {}
+
+  Arena(const Arena &) = delete;
+  Arena &operator=(const Arena &) = delete;
+
+  /** Releases the chunks; blocks from them must not be in use anymore */
+  ~Arena() override {
+    while (chunks) {
+      Chunk *previous = chunks->previous;
+      upstream->deallocate(chunks, CHUNK, ALIGN);
+      chunks = previous;
+    }
+  }
+
+  /** Bytes currently taken from the heap */
+  size_t size() const { return used; }
+
+  /** Bytes that may be taken from the heap at most */
+  size_t limit() const { return budget; }
+};
@@ -0,0 +1,431 @@
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <map>
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <fstream>
+
+/* ----------------------------------------------------------------------------
+* ClickHouse export
+*
+* Aggregates delivered bytes and messages per org, device, capability, and
+* minute, and ships each minute's rows to ClickHouse in a single insert, using
+* the columnar JSONCompactColumns format over the HTTP interface. While
+* ClickHouse is unavailable, batches are spooled to a local file and sent once
+* it's back. Batches ClickHouse rejects are moved aside to `<spool>.rejected`,
+* so they don't hold up the ones after them.
+*/
+
+/** Minimal blocking HTTP/1.1 POST. Returns the status code, or -1 if we were
+unable to talk to the server. */
+int httpPost(const std::string &host, int port, const std::string &path,
+  const std::vector<std::string> &headers, const std::string &body,
+  std::string *response = NULL, int timeoutSeconds = 10) {
+
+  struct addrinfo hints{}, *addrs;
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &addrs)
+    != 0) {
+    return -1;
+  }
+
+  int fd = -1;
+  for (struct addrinfo *a = addrs; a; a = a->ai_next) {
+    fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+    if (fd < 0) continue;
+    struct timeval timeout{timeoutSeconds, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    if (connect(fd, a->ai_addr, a->ai_addrlen) == 0) break;
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(addrs);
+  if (fd < 0) return -1;
+
+  std::string request = "POST " + path + " HTTP/1.1\r\nHost: " + host
+    + "\r\nContent-Length: " + std::to_string(body.size())
+    + "\r\nConnection: close\r\n";
+  for (auto &header : headers) request += header + "\r\n";
+  request += "\r\n";
+  request += body;
+
+  for (size_t sent = 0; sent < request.size(); ) {
+    ssize_t n = send(fd, request.data() + sent, request.size() - sent,
+      MSG_NOSIGNAL);
+    if (n <= 0) {
+      close(fd);
+      return -1;
+    }
+    sent += n;
+  }
+
+  std::string reply;
+  char buffer[4096];
+  ssize_t n;
+  while ((n = recv(fd, buffer, sizeof(buffer), 0)) > 0) {
+    reply.append(buffer, n);
+  }
+  close(fd);
+
+  int status = -1;
+  if (sscanf(reply.c_str(), "HTTP/%*s %d", &status) != 1) return -1;
+  if (response) {
+    size_t bodyStart = reply.find("\r\n\r\n");
+    *response = bodyStart == std::string::npos ? "" : reply.substr(bodyStart + 4);
+  }
+  return status;
+}
+
+/** Percent-encode the given string for use in a URL query */
+std::string urlEncode(const std::string &s) {
+  static const char hex[] = "0123456789ABCDEF";
+  std::string result;
+  for (unsigned char c : s) {
+    if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~') {
+      result += c;
+    } else {
+      result += '%';
+      result += hex[c >> 4];
+      result += hex[c & 15];
+    }
+  }
+  return result;
+}
+
+/** Append s to out as a JSON string */
+void appendJsonString(std::string &out, std::string_view s) {
+  out += '"';
+  for (unsigned char c : s) {
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if (c < 0x20) {
+      char escaped[8];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      out += escaped;
+    } else {
+      out += c;
+    }
+  }
+  out += '"';
+}
+
+struct UsageCounts {
+  uint64_t bytes = 0;
+  uint64_t messages = 0;
+};
+
+class UsageExporter {
+
+public:
+  struct Config {
+    std::string host;  // export is disabled when empty
+    int port = 8123;
+    std::string user = "default";
+    std::string password;
+    std::string table = "default.mqtt_usage";
+    std::string spoolPath = "/persistence/clickhouse.spool";
+    size_t maxQueued = 16;                 // batches held in memory
+    size_t maxSpoolBytes = 256 * 1024 * 1024;
+    size_t maxKeys = 100000;               // distinct rows remembered
+  };
+
+  /** Rows of a minute, keyed by the topic prefix /org/device/@scope/capName */
+  typedef std::map<std::string, UsageCounts, std::less<>> Rows;
+
+private:
+  Config config;
+
+  // current minute, only used from the broker thread: the counts of each row,
+  // by an id given to its key when first seen, so that counting doesn't
+  // allocate
+  std::map<std::string, uint32_t, std::less<>> keyIds;
+  std::vector<UsageCounts> counts;
+  time_t currentMinute = 0;
+  uint64_t droppedRows = 0;
+
+  // batches ready to be sent, shared with the sending thread
+  std::mutex mutex;
+  std::deque<std::string> queue;
+
+  // only used from the sending thread
+  bool tableCreated = false;
+  time_t retryAt = 0;   // back off while ClickHouse is unavailable
+  int failures = 0;
+
+  std::vector<std::string> authHeaders() const {
+    return {
+      "X-ClickHouse-User: " + config.user,
+      "X-ClickHouse-Key: " + config.password
+    };
+  }
+
+  /** Run the given query, with optional data. Returns the HTTP status, -1 if
+  we were unable to talk to ClickHouse. */
+  int query(const std::string &sql, const std::string &data = "") {
+    std::string response;
+    int status = data.empty() ?
+      httpPost(config.host, config.port, "/", authHeaders(), sql, &response) :
+      httpPost(config.host, config.port, "/?query=" + urlEncode(sql),
+        authHeaders(), data, &response);
+
+    if (status != 200) {
+      printf("ClickHouse: query failed (%d): %.200s\n", status, response.c_str());
+    }
+    return status;
+  }
+
+  bool ensureTable() {
+    if (!tableCreated) {
+      tableCreated = query("CREATE TABLE IF NOT EXISTS " + config.table + " ("
+        "OrgId LowCardinality(String), "
+        "DeviceId String, "
+        "Capability LowCardinality(String), "
+        "Minute DateTime('UTC'), "
+        "Bytes UInt64, "
+        "Messages UInt64"
+        ") ENGINE = SummingMergeTree "
+        "ORDER BY (OrgId, DeviceId, Capability, Minute) "
+        "TTL Minute + INTERVAL 90 DAY") == 200;
+    }
+    return tableCreated;
+  }
+
+  /** Whether ClickHouse refused the batch itself, e.g., as malformed, rather
+  than being unavailable, overloaded, or us not being allowed in */
+  static bool rejected(int status) {
+    return status >= 400 && status < 500 && status != 401 && status != 403
+      && status != 408 && status != 429;
+  }
+
+  /** Insert the batch, or move it aside if ClickHouse rejects it. Returns
+  false if it should be retried later. */
+  bool send(const std::string &batch) {
+    if (!ensureTable()) return false;
+    int status = query("INSERT INTO " + config.table
+      + " FORMAT JSONCompactColumns", batch);
+    if (rejected(status)) {
+      printf("ClickHouse: batch rejected, moving it to %s.rejected\n",
+        config.spoolPath.c_str());
+      spool({batch}, config.spoolPath + ".rejected");
+      return true;
+    }
+    return status == 200;
+  }
+
+  /** Append batches to the given spool file (by default the spool), each
+  prefixed by its length */
+  void spool(const std::vector<std::string> &batches,
+    const std::string &path = "") {
+    std::ofstream file(path.empty() ? config.spoolPath : path,
+      std::ios::binary | std::ios::app);
+    file.seekp(0, std::ios::end);
+    for (auto &batch : batches) {
+      if ((size_t)file.tellp() + batch.size() > config.maxSpoolBytes) {
+        printf("ClickHouse: spool is full, dropping batch\n");
+        continue;
+      }
+      uint32_t length = batch.size();
+      file.write((const char *)&length, sizeof(length));
+      file.write(batch.data(), batch.size());
+    }
+  }
+
+  /** Send all spooled batches, keep those we couldn't send */
+  bool sendSpooled() {
+    std::vector<std::string> batches;
+    {
+      std::ifstream file(config.spoolPath, std::ios::binary);
+      uint32_t length;
+      while (file.read((char *)&length, sizeof(length))) {
+        std::string batch(length, '\0');
+        if (!file.read(batch.data(), length)) break;
+        batches.push_back(std::move(batch));
+      }
+    }
+    if (batches.empty()) return true;
+
+    size_t sent = 0;
+    while (sent < batches.size() && send(batches[sent])) sent++;
+    printf("ClickHouse: sent %lu of %lu spooled batches\n", sent,
+      batches.size());
+
+    remove(config.spoolPath.c_str());
+    spool(std::vector<std::string>(batches.begin() + sent, batches.end()));
+    return sent == batches.size();
+  }
+
+public:
+
+  void configure(const Config &config) {
+    this->config = config;
+  }
+
+  bool enabled() const {
+    return !config.host.empty();
+  }
+
+  /** Serialize the given rows as a JSONCompactColumns block */
+  static std::string serialize(const Rows &rows, time_t minute) {
+    char minuteStr[32];
+    struct tm tm;
+    gmtime_r(&minute, &tm);
+    strftime(minuteStr, sizeof(minuteStr), "%Y-%m-%d %H:%M:%S", &tm);
+
+    std::string orgs, devices, capabilities, minutes, bytes, messages;
+    for (auto &row : rows) {
+      // split /org/device/@scope/capName
+      std::string_view key = row.first;
+      size_t orgEnd = key.find('/', 1);
+      size_t deviceEnd = key.find('/', orgEnd + 1);
+      const char *sep = orgs.empty() ? "" : ",";
+
+      orgs += sep;
+      appendJsonString(orgs, key.substr(1, orgEnd - 1));
+      devices += sep;
+      appendJsonString(devices, key.substr(orgEnd + 1, deviceEnd - orgEnd - 1));
+      capabilities += sep;
+      appendJsonString(capabilities, key.substr(deviceEnd + 1));
+      minutes += sep;
+      appendJsonString(minutes, minuteStr);
+      bytes += sep + std::to_string(row.second.bytes);
+      messages += sep + std::to_string(row.second.messages);
+    }
+
+    return "[[" + orgs + "],[" + devices + "],[" + capabilities + "],["
+      + minutes + "],[" + bytes + "],[" + messages + "]]";
+  }
+
+  /** Count a message of the given size delivered on topic. Only allocates for
+  rows not seen before. */
+  void record(const char *topic, uint32_t size, time_t now) {
+    if (!enabled() || topic[0] != '/') return;
+
+    // find the end of /org/device/@scope/capName
+    const char *end = topic;
+    for (int i = 0; i < 4 && end; i++) {
+      end = strchr(end + 1, '/');
+    }
+    std::string_view key = end ?
+      std::string_view(topic, end - topic) : std::string_view(topic);
+    if (std::count(key.begin(), key.end(), '/') != 4) return;
+
+    rotate(now);
+    auto it = keyIds.find(key);
+    if (it == keyIds.end()) {
+      if (keyIds.size() >= config.maxKeys) {
+        droppedRows++;
+        return;
+      }
+      it = keyIds.emplace(key, counts.size()).first;
+      counts.push_back({});
+    }
+    UsageCounts &row = counts[it->second];
+    row.bytes += size;
+    row.messages++;
+  }
+
+  /** Queue the current minute's rows for sending once the minute is over, or
+  right away if forced. */
+  void rotate(time_t now, bool force = false) {
+    time_t minute = now - now % 60;
+    if (minute == currentMinute && !force) return;
+
+    Rows rows;
+    for (auto &[key, id] : keyIds) {
+      if (counts[id].messages > 0) {
+        rows.emplace(key, counts[id]);
+        counts[id] = {};
+      }
+    }
+    if (keyIds.size() >= config.maxKeys) {
+      // start over, forgetting the keys of devices long gone
+      keyIds.clear();
+      counts.clear();
+    }
+
+    if (!rows.empty()) {
+      std::string batch = serialize(rows, currentMinute);
+
+      std::lock_guard<std::mutex> lock(mutex);
+      if (queue.size() >= config.maxQueued) {
+        // sender can't keep up, shed the oldest batch
+        printf("ClickHouse: queue is full, dropping oldest batch\n");
+        queue.pop_front();
+      }
+      queue.push_back(std::move(batch));
+    }
+
+    if (droppedRows > 0) {
+      printf("ClickHouse: not counting %lu messages, more than %lu keys\n",
+        droppedRows, config.maxKeys);
+      droppedRows = 0;
+    }
+    currentMinute = minute;
+  }
+
+  /** Number of batches waiting to be sent */
+  size_t queued() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return queue.size();
+  }
+
+  /** Send all queued and spooled batches. Blocking, to be called from a
+  background thread. */
+  void flush() {
+    if (!enabled()) return;
+
+    std::deque<std::string> batches;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      batches.swap(queue);
+    }
+
+    // send spooled ones first, to keep order; if ClickHouse is still
+    // unavailable, spool the new ones as well
+    time_t now = time(NULL);
+    bool available = now >= retryAt && sendSpooled();
+    while (available && !batches.empty()) {
+      if (!send(batches.front())) break;
+      batches.pop_front();
+    }
+
+    if (!batches.empty() || !available) {
+      if (!batches.empty()) {
+        printf("ClickHouse: unavailable, spooling %lu batches\n",
+          batches.size());
+        spool(std::vector<std::string>(batches.begin(), batches.end()));
+      }
+      if (now >= retryAt) {
+        failures = std::min(failures + 1, 8);
+        retryAt = now + (5 << failures); // up to about 20 minutes
+      }
+    } else {
+      failures = 0;
+    }
+  }
+
+  /** Spool everything not yet sent, without any network access. */
+  void shutdown(time_t now) {
+    if (!enabled()) return;
+    rotate(now, true);
+    std::lock_guard<std::mutex> lock(mutex);
+    spool(std::vector<std::string>(queue.begin(), queue.end()));
+    queue.clear();
+  }
+};
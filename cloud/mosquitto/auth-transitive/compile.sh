@@ -1 +1,4 @@
-g++ -std=c++2a -Wfatal-errors -fPIC -shared -fmax-errors=1 -I../../include -I../.. -I/tmp/jwt-cpp-0.7.0/include/   mosquitto_auth_transitive.cpp -o /mosquitto/mosquitto_auth_transitive.so   $(pkg-config --cflags --libs libmongocxx)
+# without systemtap's sdt.h, build without the USDT probes, see probes.hpp
+echo '#include <sys/sdt.h>' | g++ -E -x c++ - > /dev/null 2>&1 \
+  || { echo "sys/sdt.h not found, building without probes"; PROBES=-DTRANSITIVE_NO_PROBES; }
+g++ -std=c++2a -Wfatal-errors -fPIC -shared -fmax-errors=1 $PROBES -I../../include -I../.. -I/tmp/jwt-cpp-0.7.0/include/   mosquitto_auth_transitive.cpp -o /mosquitto/mosquitto_auth_transitive.so   $(pkg-config --cflags --libs libmongocxx)
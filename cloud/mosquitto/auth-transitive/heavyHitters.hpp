@@ -0,0 +1,276 @@
+
+#include <string.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/* ----------------------------------------------------------------------------
+* Heavy hitters
+*
+* Finds the keys (topics, clients, orgs) with the most messages and bytes over
+* a sliding window, in constant time and memory per update: a count-min sketch
+* per sub-window estimates the counts of any key, and only the current top K
+* candidates are stored by name. Candidates live in fixed-size slots, found by
+* hash and ordered in a min-heap by their estimate, so an update neither
+* allocates nor scans them all.
+*/
+
+class HeavyHitters {
+
+public:
+  static const int DEPTH = 4;
+  static const int WIDTH = 1024;  // power of two
+  static const int WINDOWS = 6;   // sub-windows making up the sliding window
+  static constexpr size_t MAX_KEY = 256; // longer keys are kept truncated
+
+  struct Hitter {
+    std::string key;
+    uint64_t messages;
+    uint64_t bytes;
+  };
+
+private:
+  struct Sketch {
+    uint32_t messages[DEPTH][WIDTH];
+    uint64_t bytes[DEPTH][WIDTH];
+  };
+
+  /** A candidate and its estimate */
+  struct Candidate {
+    uint64_t hash;
+    uint64_t estimate;
+    uint32_t heapIndex; // where in the heap it is
+    uint32_t length;
+    char key[MAX_KEY];
+  };
+
+  /** The top candidates by one metric. Slots [0, heap.size()) are in use. */
+  struct Candidates {
+    std::vector<Candidate> slots;
+    std::vector<uint32_t> heap;  // slots, min-heap by estimate
+    std::vector<int32_t> index;  // slots by hash, linear probing, -1 if empty
+  };
+
+  size_t k;
+  std::vector<Sketch> windows;
+  Sketch total;  // sum of all windows
+  int current = 0;
+  Candidates byMessages, byBytes;
+
+  static uint64_t hash(std::string_view key) {
+    uint64_t hash = 14695981039346656037ull; // FNV-1a
+    for (unsigned char c : key) {
+      hash = (hash ^ c) * 1099511628211ull;
+    }
+    return hash;
+  }
+
+  static size_t slot(uint64_t hash, int row) {
+    // double hashing to get DEPTH independent-enough slots
+    return (hash + row * ((hash >> 32) | 1)) & (WIDTH - 1);
+  }
+
+  template<typename T>
+  static T estimate(const T (&counts)[DEPTH][WIDTH], uint64_t hash) {
+    T result = counts[0][slot(hash, 0)];
+    for (int row = 1; row < DEPTH; row++) {
+      result = std::min(result, counts[row][slot(hash, row)]);
+    }
+    return result;
+  }
+
+  void init(Candidates &candidates) {
+    candidates.slots.resize(k);
+    candidates.heap.reserve(k);
+    size_t size = 4;
+    while (size < 2 * k) size *= 2;
+    candidates.index.assign(size, -1);
+  }
+
+  static bool less(const Candidates &candidates, size_t a, size_t b) {
+    return candidates.slots[candidates.heap[a]].estimate
+      < candidates.slots[candidates.heap[b]].estimate;
+  }
+
+  static void swap(Candidates &candidates, size_t a, size_t b) {
+    std::swap(candidates.heap[a], candidates.heap[b]);
+    candidates.slots[candidates.heap[a]].heapIndex = a;
+    candidates.slots[candidates.heap[b]].heapIndex = b;
+  }
+
+  /** Restore the heap order for the entry at i, after its estimate changed */
+  static void sift(Candidates &candidates, size_t i) {
+    while (i > 0 && less(candidates, i, (i - 1) / 2)) {
+      swap(candidates, i, (i - 1) / 2);
+      i = (i - 1) / 2;
+    }
+    size_t size = candidates.heap.size();
+    while (true) {
+      size_t smallest = i;
+      for (size_t child = 2 * i + 1; child <= 2 * i + 2; child++) {
+        if (child < size && less(candidates, child, smallest)) smallest = child;
+      }
+      if (smallest == i) return;
+      swap(candidates, i, smallest);
+      i = smallest;
+    }
+  }
+
+  /** The slot holding key, -1 if none */
+  static int find(const Candidates &candidates, std::string_view key,
+    uint64_t h) {
+    size_t length = std::min(key.size(), MAX_KEY);
+    size_t mask = candidates.index.size() - 1;
+    for (size_t i = h & mask; candidates.index[i] >= 0; i = (i + 1) & mask) {
+      const Candidate &candidate = candidates.slots[candidates.index[i]];
+      if (candidate.hash == h && candidate.length == length
+        && memcmp(candidate.key, key.data(), length) == 0) {
+        return candidates.index[i];
+      }
+    }
+    return -1;
+  }
+
+  static void addToIndex(Candidates &candidates, int32_t number) {
+    size_t mask = candidates.index.size() - 1;
+    size_t i = candidates.slots[number].hash & mask;
+    while (candidates.index[i] >= 0) i = (i + 1) & mask;
+    candidates.index[i] = number;
+  }
+
+  static void removeFromIndex(Candidates &candidates, int32_t number) {
+    size_t mask = candidates.index.size() - 1;
+    size_t i = candidates.slots[number].hash & mask;
+    while (candidates.index[i] != number) i = (i + 1) & mask;
+    // move back entries that would no longer be found past the gap
+    for (size_t j = (i + 1) & mask; candidates.index[j] >= 0;
+      j = (j + 1) & mask) {
+      size_t home = candidates.slots[candidates.index[j]].hash & mask;
+      if (((j - home) & mask) >= ((j - i) & mask)) {
+        candidates.index[i] = candidates.index[j];
+        i = j;
+      }
+    }
+    candidates.index[i] = -1;
+  }
+
+  static void setKey(Candidate &candidate, std::string_view key, uint64_t h,
+    uint64_t estimate) {
+    candidate.hash = h;
+    candidate.estimate = estimate;
+    candidate.length = std::min(key.size(), MAX_KEY);
+    memcpy(candidate.key, key.data(), candidate.length);
+  }
+
+  void offer(Candidates &candidates, std::string_view key, uint64_t h,
+    uint64_t estimate) {
+
+    int found = find(candidates, key, h);
+    if (found >= 0) {
+      candidates.slots[found].estimate = estimate;
+      sift(candidates, candidates.slots[found].heapIndex);
+      return;
+    }
+
+    if (candidates.heap.size() < k) {
+      uint32_t number = candidates.heap.size();
+      setKey(candidates.slots[number], key, h, estimate);
+      candidates.slots[number].heapIndex = number;
+      candidates.heap.push_back(number);
+      addToIndex(candidates, number);
+      sift(candidates, number);
+      return;
+    }
+
+    // replace the minimum
+    uint32_t number = candidates.heap[0];
+    if (estimate <= candidates.slots[number].estimate) return;
+    removeFromIndex(candidates, number);
+    setKey(candidates.slots[number], key, h, estimate);
+    addToIndex(candidates, number);
+    sift(candidates, 0);
+  }
+
+  /** Re-estimate all candidates, forget those that dropped out of the window */
+  void refresh(Candidates &candidates, bool bytes) {
+    size_t live = 0;
+    for (size_t i = 0; i < candidates.heap.size(); i++) {
+      Candidate &candidate = candidates.slots[i];
+      candidate.estimate = bytes ? estimate(total.bytes, candidate.hash)
+        : estimate(total.messages, candidate.hash);
+      if (candidate.estimate > 0) {
+        if (live != i) candidates.slots[live] = candidate;
+        live++;
+      }
+    }
+
+    candidates.heap.clear();
+    std::fill(candidates.index.begin(), candidates.index.end(), -1);
+    for (uint32_t number = 0; number < live; number++) {
+      candidates.slots[number].heapIndex = number;
+      candidates.heap.push_back(number);
+      addToIndex(candidates, number);
+    }
+    for (size_t i = live / 2; i-- > 0; ) {
+      sift(candidates, i);
+    }
+  }
+
+public:
+
+  HeavyHitters(size_t k = 10) : k(k), windows(WINDOWS) {
+    memset(windows.data(), 0, sizeof(Sketch) * WINDOWS);
+    memset(&total, 0, sizeof(Sketch));
+    init(byMessages);
+    init(byBytes);
+  }
+
+  /** Count one message of the given size for key */
+  void add(std::string_view key, uint32_t bytes) {
+    uint64_t h = hash(key);
+    Sketch &window = windows[current];
+    for (int row = 0; row < DEPTH; row++) {
+      size_t i = slot(h, row);
+      window.messages[row][i]++;
+      window.bytes[row][i] += bytes;
+      total.messages[row][i]++;
+      total.bytes[row][i] += bytes;
+    }
+    offer(byMessages, key, h, estimate(total.messages, h));
+    offer(byBytes, key, h, estimate(total.bytes, h));
+  }
+
+  /** Advance the sliding window by one sub-window, dropping the oldest one */
+  void rotate() {
+    current = (current + 1) % WINDOWS;
+    Sketch &oldest = windows[current];
+    for (int row = 0; row < DEPTH; row++) {
+      for (int i = 0; i < WIDTH; i++) {
+        total.messages[row][i] -= oldest.messages[row][i];
+        total.bytes[row][i] -= oldest.bytes[row][i];
+      }
+    }
+    memset(&oldest, 0, sizeof(Sketch));
+    refresh(byMessages, false);
+    refresh(byBytes, true);
+  }
+
+  /** The current top K, by bytes or by messages, heaviest first */
+  std::vector<Hitter> top(bool byBytes) const {
+    const Candidates &candidates = byBytes ? this->byBytes : byMessages;
+    std::vector<Hitter> result;
+    for (uint32_t number : candidates.heap) {
+      const Candidate &candidate = candidates.slots[number];
+      result.push_back({std::string(candidate.key, candidate.length),
+          estimate(total.messages, candidate.hash),
+          estimate(total.bytes, candidate.hash)});
+    }
+    std::sort(result.begin(), result.end(), [byBytes](auto &a, auto &b) {
+        return byBytes ? a.bytes > b.bytes : a.messages > b.messages;
+      });
+    return result;
+  }
+};
@@ -2,7 +2,6 @@
 #include <time.h> // for timing the reduction of counters
 #include <string>
 #include <vector>
-#include <numeric> // std::accumulate
 
 // for MongoDB
 #include <cstdint>
@@ -19,6 +18,7 @@ using bsoncxx::builder::basic::make_document;
 // using bsoncxx::builder::stream::document;
 using bsoncxx::v_noabi::document::element;
 
+// uses Policy and Grant from policy.hpp
 
 #define AGENT_CAP "@transitive-robotics/_robot-agent"
 
@@ -43,93 +43,37 @@ int operator+(const element& a, const element& b) {
 
 /* -------------------------------------------------------------------------- */
 
-/** Whether or not the array contains a prefix of s. */
-bool arrayIncludesPrefix(const element& array, const std::string& s) {
-  bsoncxx::array::view view{array.get_array().value};
+/** Compile the permissions granted by the given user's json, i.e., the id and
+the JWT payload verified during authentication. */
+static Grant compileGrant(const std::string &username) {
+  auto doc = bsoncxx::from_json(username);
+  auto permitted = doc["payload"];
+  Grant grant;
+
+  auto stringOf = [](const element &e) {
+    return e && e.type() == bsoncxx::type::k_string ?
+      std::string(e.get_string().value) : std::string();
+  };
 
-  for (bsoncxx::array::element item : view){
-    // std::string itemStr = item.get_string().value.to_string();
-    std::string itemStr{item.get_string().value};
-    if (s.starts_with(itemStr)) {
-      return true;
+  if (doc["id"] && permitted["id"] && doc["id"] == permitted["id"]) {
+    grant.org = stringOf(doc["id"]);
+  }
+  grant.device = stringOf(permitted["device"]);
+  grant.capability = stringOf(permitted["capability"]);
+
+  // if payload.topics exists it is a limitation of topics to allow
+  // TODO: allow wildcards in permitted.topics ?
+  auto topics = permitted["topics"];
+  grant.topicConstraints = bool(topics);
+  if (topics && topics.type() == bsoncxx::type::k_array) {
+    bsoncxx::array::view view{topics.get_array().value};
+    for (bsoncxx::array::element item : view) {
+      grant.topics.push_back(stringOf(item));
     }
   }
-  return false;
-}
-
-/** Given a user's json, payload from JWT verified during basic_auth, and a
-topic, decide whether the user should be granted access to the given topic.
-*/
-static int isAuthorized(std::vector<std::string> topicParts, std::string username,
-  bool readAccess = false) {
-
-  if (topicParts.size() < 5) return false;
-
-  auto doc = bsoncxx::from_json(username);
-  auto permitted = doc["payload"];
 
-  // requested
-  auto org = topicParts[1];
-  auto device = topicParts[2];
-  auto capability = topicParts[3] + '/' + topicParts[4];
-
-  /// join the topicParts of the sub-topic
-  std::string sub = topicParts.size() < 7 ? "" : std::accumulate(
-    std::next(topicParts.begin() + 6), topicParts.end(), topicParts[6],
-    [](std::string a, std::string b) { return a + "/" + b; }
-  );
-  // std::cout << "sub: " << sub << std::endl;
-
-  bool deviceMatch = (permitted["device"] == device);
-  bool capMatch = (permitted["capability"] == capability);
-  bool agentPermission = (permitted["capability"] == AGENT_CAP);
-  bool agentRequested = (capability == AGENT_CAP);
-  bool fleetPermission = (permitted["device"] == "_fleet");
-  bool noTopicConstraints = !permitted["topics"];
-
-  // for (auto p : topicParts) std::cout << p << '/';
-  // std::cout << "  authorized?" << " " << username << " " << readAccess << std::endl;
-  // std::cout << deviceMatch << capMatch << agentPermission << agentRequested
-  // << fleetPermission << noTopicConstraints << std::endl;
-
-  // std::cout << "permitted:" << username << sub << std::endl;
-
-  std::time_t currentTime = std::time(nullptr);
-
-  if (
-    doc["id"] == permitted["id"] && doc["id"] == org &&
-    // JWT still valid
-    permitted["validity"] && permitted["iat"] &&
-    (permitted["iat"] + permitted["validity"]) > currentTime &&
-    (
-      ( deviceMatch && (
-          (
-            ( capMatch || agentPermission )
-            // _robot-agent permissions grant full device access
-            &&
-            // if payload.topics exists it is a limitation of topics to allow:
-            (noTopicConstraints || arrayIncludesPrefix(permitted["topics"], sub))
-            // TODO: allow wildcards in permitted.topics ?
-          ) ||
-          // all valid JWTs for a device also grant read access to _robot-agent
-          ( readAccess && agentRequested )
-        )
-      )
-
-      || // _fleet permissions give read access also to all devices' robot-agents
-      ( fleetPermission && readAccess && agentRequested && noTopicConstraints)
-
-      || // _fleet permissions give access to all devices' data for the
-      // cap (in the permitted org only of course); _robot-agent permissions
-      // grant access to all devices in the fleet
-      ( fleetPermission && (capMatch || agentPermission) && noTopicConstraints)
-    )) {
-
-    // std::cout << ": yes!" << std::endl;
-    return true;
-
-  } else {
-    // std::cout << ": no!" << std::endl;
-    return false;
+  if (permitted["validity"] && permitted["iat"]) {
+    grant.expires = permitted["iat"] + permitted["validity"];
   }
+  return grant;
 }
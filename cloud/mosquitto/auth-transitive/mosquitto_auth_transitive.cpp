@@ -5,8 +5,6 @@
 #include <stdlib.h> // system calls
 #include <time.h> // for timing the reduction of counters
 
-// for "cron jobs"
-#include <thread>
 #include <functional>
 
 #include "mosquitto_broker.h"
@@ -15,14 +13,18 @@
 #include "mqtt_protocol.h"
 
 #include <string>
+#include <string_view>
 #include <map>
+#include <unordered_map>
+#include <memory>
 #include <utility>
 
 #include <iostream>
 #include <sstream>
+#include <fstream>
 #include <vector>
 
-#include <chrono> // for cron jobs
+#include <chrono>
 #include <ctime>
 
 
@@ -48,92 +50,424 @@ using bsoncxx::v_noabi::document::element;
 // JWT
 #include <jwt-cpp/jwt.h>
 
+#include "usageLog.hpp"
+#include "clickhouse.hpp"
+#include "heavyHitters.hpp"
+#include "quota.hpp"
+#include "topics.hpp"
+#include "policy.hpp"
 #include "isAuthorized.hpp"
-
-
-static mosquitto_plugin_id_t *mosq_pid = NULL;
+#include "snapshot.hpp"
+#include "scheduler.hpp"
+#include "admission.hpp"
+#include "sharedState.hpp"
+#include "timerWheel.hpp"
+#include "allocCount.hpp"
+#include "probes.hpp"
+#include "arena.hpp"
+
+
+/** Get the value of the given plugin option (plugin_opt_<key>), if present */
+std::string getOption(struct mosquitto_opt *opts, int opt_count,
+  const char *key, const std::string &defaultValue = "") {
+
+  for (int i = 0; i < opt_count; i++) {
+    if (strcmp(opts[i].key, key) == 0) {
+      return opts[i].value;
+    }
+  }
+  return defaultValue;
+}
 
 /** return true if is `pre` a prefix of `str` */
 bool prefix(const char *pre, const char *str) {
   return strncmp(pre, str, strlen(pre)) == 0;
 }
 
-/** Split the given string using the delimiter, return a vector */
-std::vector<std::string> split(const std::string &s, char delim, int max = 100) {
-  std::vector<std::string> result;
-  std::stringstream ss(s);
-  std::string item;
-  int i = 0;
+/// Runs background work on the broker thread, from the tick event, see catchUp
+Scheduler scheduler;
+/// Runs blocking I/O (Mongo, ClickHouse, ipset) off the broker thread
+Worker worker;
+/// Time-based events: token, cache, and rate limit expiry, advanced each tick
+TimerWheel timers;
 
-  while (i++ < max && getline(ss, item, delim)) {
-    result.push_back(item);
-  }
+/* ---------------------------------------------------------------------------
+Plugin instances
+
+With `per_listener_settings true` mosquitto initializes the plugin once for
+each listener, with that listener's plugin options. The instances share the
+library and with it the process-wide state, like usage, quotas, and the
+background work, which the first instance sets up and the last tears down.
+Everything specific to a listener lives in its instance, passed to the
+callbacks as user data.
+
+Mosquitto 2.0 sends tick events only to plugins configured globally, not to
+those of a listener, so with per_listener_settings the background work runs
+from the other callbacks instead, see catchUp.
+*/
 
-  return result;
-}
+/** The kind of clients on a listener (plugin_opt_listener) */
+enum ListenerMode {
+  ANY_LISTENER,      // any, the default
+  MTLS_LISTENER,     // robots and capabilities, named by their certificate
+  WEBSOCKET_LISTENER // web clients, with a JWT and a JSON username
+};
+const char *listenerModeNames[] = {"any", "mtls", "websockets"};
 
-/** Repeatedly call func with interval seconds in between */
-void interval(std::function<void(void)> func, unsigned int interval) {
-  std::thread([func, interval]() {
-    while (true) {
-      std::this_thread::sleep_for(std::chrono::milliseconds(interval));
-      func();
-    }
-  }).detach();
-}
+typedef struct instance_struct {
+  mosquitto_plugin_id_t *pid;
+  ListenerMode mode = ANY_LISTENER;
+  MOSQ_FUNC_generic_callback acl; // specialized for the mode
+  bool control = false;           // whether it answers on the control topic
+  bool extAuth = false;           // whether it does extended authentication
+
+  // Heap allocations made by each callback, see allocCount.hpp
+  AllocStats aclAllocs, basicAuthAllocs, extAuthAllocs, disconnectAllocs,
+    tickAllocs, controlAllocs;
+} instance_struct;
+
+/// The initialized instances, the first one set up the process-wide state
+std::vector<instance_struct *> instances;
+
+/// How much of each tick background work on the broker thread may take
+const std::chrono::microseconds tickBudget(2000);
+/// Whether the broker sends us tick events, see catchUp
+bool ticking = false;
+/// When background work last ran
+time_t lastBackgroundRun = 0;
 
-typedef struct user_struct {
+void catchUp();
+
+typedef struct account_struct {
   std::string jwt_secret; // JWT secret
-  std::map<std::string, long int> cap_usage; // per capability usgae
   bool canPay; // has free account or has a valid payment method and is not delinquent
-} user;
+  std::string plan = "unpaid"; // determines quotas, see QuotaPolicy
+  std::map<std::string, long int> cap_usage; // this month's usage as recorded in Mongo
+} account;
+
+/** Hash for looking up std::string keys by string_view */
+struct string_hash {
+  using is_transparent = void;
+  size_t operator()(std::string_view s) const {
+    return std::hash<std::string_view>{}(s);
+  }
+};
 
-/// Hash table for user accounts, used to cache JWTs and track read quotas
-std::map<std::string, user> users;
+/** All accounts and the quota policy, as of one refetch */
+typedef struct accounts_struct {
+  std::unordered_map<std::string, account, string_hash, std::equal_to<>> byId;
+  QuotaPolicy quotaPolicy; // read quotas and rates per capability and plan
+  uint64_t version = 0;
 
+  const account *find(std::string_view id) const {
+    auto it = byId.find(id);
+    return it == byId.end() ? NULL : &it->second;
+  }
+} accounts_table;
+
+/// The current accounts, published by refetchUsers; used to verify JWTs and
+/// to set read quotas
+Snapshot<accounts_table> accounts;
+
+/** Usage of an org this month, per capability */
+typedef struct usage_struct {
+  std::string id; // the org
+  std::map<std::string, meter, std::less<>> cap_usage; // per capability usage and quota
+  std::map<std::string, long int> cap_logged; // part of cap_usage that is in Mongo or the usage log
+  std::string plan = "unpaid"; // the plan the quotas in cap_usage are for
+  bool loaded = false; // whether we have added the usage recorded in Mongo yet
+  bool restored = false; // whether its totals came from the usage log instead
+  uint64_t published = 0; // signature of the last published summary, see publishUsage
+  shaper shaping; // read rate of the org as a whole
+} org_usage;
+
+/// Usage per org, only used on the broker thread
+std::map<std::string, org_usage, std::less<>> usage;
+/// Version of the accounts snapshot that usage is in sync with
+uint64_t usageAccountsVersion = 0;
+
+/// Crash-durable log of usage not yet recorded in Mongo
+UsageLog usageLog;
+/// Where the usage log is, for when this process becomes the flusher
+std::string usageLogPath;
+
+/// Meter totals and read buckets shared with the other broker processes on
+/// this host, when enabled by the shared_state option, see sharedState.hpp
+SharedCounters sharedState;
+/// Number of shared keys the flusher has meters for, see adoptSharedMeters
+size_t adoptedSharedKeys = 0;
+/// The month the usage counters belong to, see usageMonth
+int meterMonth = 0;
+
+const time_t usageCommitInterval = 1; // seconds
+
+/// Per-minute usage per device, shipped to ClickHouse
+UsageExporter usageExporter;
+
+/// Default quota, used when no quotas are defined in Mongo
 const long int maxBytes = 100 * 1024 * 1024;
 // const long int maxBytes = 100 * 1024; // #DEBUG
+/// Message classes whose reads are never rate-shaped (plugin_opt_unshaped):
+/// by default the agent's status and commands
+Unshaped unshaped;
 
 const time_t cacheExpiration = 300; // seconds
-// cache of client permissions
-std::map<std::string, std::map<std::string, time_t>> clientPermissions;
 
 /* ----------------------------------------------------------------------------
 * Mongo
 */
 
-/** Connect to MongoDB (at most once) and get accounts collection. */
-mongocxx::collection& getAccountsCollection() {
+/** Connect to MongoDB (at most once) and get the database. */
+mongocxx::database& getDatabase() {
   static mongocxx::instance instance{}; // This should be done only once.
   static mongocxx::uri uri("mongodb://mongodb:27017");
   static mongocxx::client client(uri);
   static auto db = client["transitive"];
-  static mongocxx::collection accounts = db["accounts"];
 
+  return db;
+}
+
+/** Get accounts collection. */
+mongocxx::collection& getAccountsCollection() {
+  static mongocxx::collection accounts = getDatabase()["accounts"];
   return accounts;
 }
 
-/** Fetch all users from MongoDB, including their JWTs and data usage stats */
+/** Get quotas collection: { _id: capability name, limits: { plan: bytes } } */
+mongocxx::collection& getQuotasCollection() {
+  static mongocxx::collection quotas = getDatabase()["quotas"];
+  return quotas;
+}
+
+/** Get a numeric bson value as long, regardless of its bson type */
+long int getLong(const element &e) {
+  switch (e.type()) {
+    case bsoncxx::type::k_int32: return e.get_int32().value;
+    case bsoncxx::type::k_int64: return e.get_int64().value;
+    case bsoncxx::type::k_double: return e.get_double().value;
+    default: return 0;
+  }
+}
+
+/** Get the account with the given id from the current snapshot, if any */
+const account *findAccount(std::string_view id) {
+  const accounts_table *table = accounts.get();
+  return table ? table->find(id) : NULL;
+}
+
+/** The read quota for the given capability and plan */
+long int quotaLimit(std::string_view capability, std::string_view plan) {
+  const accounts_table *table = accounts.get();
+  return table ? table->quotaPolicy.limit(capability, plan) : UNLIMITED;
+}
+
+/** The read rate for the given capability (`*` for the org) and plan */
+long int quotaRate(std::string_view capability, std::string_view plan) {
+  const accounts_table *table = accounts.get();
+  return table ? table->quotaPolicy.rate(capability, plan) : UNLIMITED;
+}
+
+/** The largest payload the capability may publish on the given sub-topic */
+long int maxPayload(std::string_view capability, std::string_view sub) {
+  const accounts_table *table = accounts.get();
+  return table ? table->quotaPolicy.maxPayload(capability, sub) : UNLIMITED;
+}
+
+/** Keep the state of the given bucket in shared memory, if enabled */
+void shareBucket(const std::string &key, shaper &bucket) {
+  SharedCounters::Slot *slot = sharedState.find("r/" + key);
+  if (slot) {
+    bucket.share(&slot->value, &slot->stamp, scheduler.now());
+  }
+}
+
+/** Keep the total of the given meter and its bucket in shared memory, if
+enabled */
+void shareMeter(const std::string &org, std::string_view capability,
+  meter &m) {
+  if (!sharedState.isOpen()) return;
+  std::string key = org + "/" + std::string(capability);
+  SharedCounters::Slot *slot = sharedState.find("q/" + key);
+  if (slot) {
+    m.shared = &slot->value;
+    m.bytes = m.total();
+  }
+  shareBucket(key, m.shaping);
+}
+
+/** Whether to add the usage Mongo has for the given org to its meters: once,
+or when shared, once among all processes. */
+bool firstToLoad(const std::string &org) {
+  if (!sharedState.isOpen()) return true;
+  SharedCounters::Slot *slot = sharedState.find("l/" + org);
+  int64_t notLoaded = 0;
+  return !slot || slot->value.compare_exchange_strong(notLoaded, 1);
+}
+
+meter &getCapMeter(org_usage &u, std::string_view capability);
+
+/** Get the usage of the given org, creating it if needed. */
+org_usage &getOrgUsage(std::string_view org) {
+  auto it = usage.find(org);
+  if (it == usage.end()) {
+    it = usage.emplace(org, org_usage{}).first;
+    it->second.id = org;
+    if (sharedState.isOpen()) {
+      shareBucket(it->second.id, it->second.shaping);
+    }
+  }
+
+  org_usage &u = it->second;
+  const account *acc = findAccount(org);
+  if (acc && !u.loaded) {
+    // add the usage Mongo has for this month; only once, after that our own
+    // counters are ahead of Mongo. Totals restored from the usage log already
+    // include it.
+    u.plan = acc->plan;
+    bool load = !u.restored && firstToLoad(u.id);
+    for (auto &recorded : acc->cap_usage) {
+      meter &m = getCapMeter(u, recorded.first);
+      if (load) m.add(recorded.second);
+      m.setLimit(quotaLimit(recorded.first, u.plan));
+      m.shaping.setRate(quotaRate(recorded.first, u.plan), scheduler.now());
+      if (!u.restored) u.cap_logged[recorded.first] += recorded.second;
+    }
+    u.shaping.setRate(quotaRate("*", u.plan), scheduler.now());
+    u.loaded = true;
+  }
+  return u;
+}
+
+/** Get the meter for the given capability, creating it if needed. */
+meter &getCapMeter(org_usage &u, std::string_view capability) {
+  auto it = u.cap_usage.find(capability);
+  if (it == u.cap_usage.end()) {
+    it = u.cap_usage.emplace(capability, meter{}).first;
+    if (!UsageLog::fits(u.id, capability)) {
+      // rejected once here, rather than on every commit, see logUsageTotals
+      printf("Not logging usage of %s, %.*s: name too long, recording it in "
+        "Mongo only\n", u.id.c_str(), (int)capability.size(), capability.data());
+    }
+    shareMeter(u.id, capability, it->second);
+    it->second.setLimit(quotaLimit(capability, u.plan));
+    it->second.shaping.setRate(quotaRate(capability, u.plan), scheduler.now());
+  }
+  return it->second;
+}
+
+/** Bring usage in line with a newly published accounts snapshot: add what
+Mongo has for orgs we haven't loaded yet, and (re-)apply plans, quotas, and
+rates. */
+void syncUsage() {
+  const accounts_table *table = accounts.get();
+  if (!table || table->version == usageAccountsVersion) return;
+
+  for (auto &entry : table->byId) {
+    getOrgUsage(entry.first).plan = entry.second.plan;
+  }
+  time_t now = scheduler.now();
+  for (auto &entry : usage) {
+    const std::string &plan = entry.second.plan;
+    entry.second.shaping.setRate(table->quotaPolicy.rate("*", plan), now);
+    for (auto &capUsage : entry.second.cap_usage) {
+      capUsage.second.setLimit(table->quotaPolicy.limit(capUsage.first, plan));
+      capUsage.second.shaping.setRate(
+        table->quotaPolicy.rate(capUsage.first, plan), now);
+    }
+  }
+  usageAccountsVersion = table->version;
+}
+
+/** Get the meter for the given org and capability, creating it if needed. */
+meter& getMeter(std::string_view org, std::string_view capability) {
+  return getCapMeter(getOrgUsage(org), capability);
+}
+
+/** Fetch quota definitions from MongoDB: monthly byte limits per plan in
+`limits`, read rates in bytes per second per plan in `rates`, and payload
+limits per topic class in `maxPayload`. The document with _id `*` holds the
+rates for each org as a whole, and in `defaultMaxPayload` the payload limits of
+capabilities without their own. */
+QuotaPolicy fetchQuotas() {
+  QuotaPolicy policy;
+  PROBE2(mongo_entry, "find", "quotas");
+  for (auto doc : getQuotasCollection().find({})) {
+    if (doc["_id"].type() != bsoncxx::type::k_string) continue;
+    std::string capability = (std::string)doc["_id"].get_string().value;
+    if (!UsageLog::fits("", capability)) {
+      std::cerr << "ERROR: ignoring quotas of " << capability
+      << ": name too long" << endl;
+      continue;
+    }
+    if (doc["limits"]) {
+      for (auto &limit : doc["limits"].get_document().value) {
+        policy.set(capability, (std::string)limit.key(), getLong(limit));
+        cout << "quota " << capability << ", " << limit.key() << ": "
+        << getLong(limit) << endl;
+      }
+    }
+    if (doc["rates"]) {
+      for (auto &rate : doc["rates"].get_document().value) {
+        policy.setRate(capability, (std::string)rate.key(), getLong(rate));
+        cout << "rate " << capability << ", " << rate.key() << ": "
+        << getLong(rate) << " B/s" << endl;
+      }
+    }
+    if (doc["maxPayload"] && capability == "*") {
+      std::cerr << "ERROR: ignoring maxPayload of *, the default payload limits "
+      << "are in defaultMaxPayload" << endl;
+    } else if (doc["maxPayload"]) {
+      for (auto &max : doc["maxPayload"].get_document().value) {
+        policy.setMaxPayload(capability, (std::string)max.key(), getLong(max));
+        cout << "max payload " << capability << ", " << max.key() << ": "
+        << getLong(max) << " B" << endl;
+      }
+    }
+    // in the `*` document, next to the org-wide rates
+    if (doc["defaultMaxPayload"] && capability == "*") {
+      for (auto &max : doc["defaultMaxPayload"].get_document().value) {
+        policy.setDefaultMaxPayload((std::string)max.key(), getLong(max));
+        cout << "default max payload " << max.key() << ": "
+        << getLong(max) << " B" << endl;
+      }
+    }
+  }
+
+  if (policy.empty()) {
+    // none defined, limit ros-tool for those who can't pay
+    policy.set("ros-tool", "unpaid", maxBytes);
+  }
+  PROBE3(mongo_return, "find", "quotas", true);
+  return policy;
+}
+
+/** Fetch all users from MongoDB, including their JWTs and data usage stats,
+and the quotas, and publish them as a new accounts snapshot. Blocking, runs on
+the worker; the broker thread picks up the snapshot in syncUsage. */
 void refetchUsers() {
   cout << "refetchUsers" << endl << std::flush;
+  static std::atomic<uint64_t> version = 0;
 
   try {
+    auto table = std::make_unique<accounts_table>();
+    PROBE2(mongo_entry, "find", "accounts");
     auto cursor_all = getAccountsCollection().find({});
 
     for (auto doc : cursor_all) {
       std::string user = (std::string)doc["_id"].get_string().value;
+      account &acc = table->byId[user];
       cout << user;
 
       // get user's jwt secret
       auto jwtSecretField = doc["jwtSecret"];
       if (jwtSecretField) {
         std::string jwtSecret = (std::string)jwtSecretField.get_string().value;
-        users[user].jwt_secret = jwtSecret;
+        acc.jwt_secret = jwtSecret;
         cout << " " << jwtSecret;
       }
 
       // check whether user can pay:
-      users[user].canPay = (doc["free"] && doc["free"].get_bool().value)
+      acc.canPay = (doc["free"] && doc["free"].get_bool().value)
       || (
         ( doc["stripeCustomer"] && (( // has payment method
               doc["stripeCustomer"]["invoice_settings"] &&
@@ -152,51 +486,132 @@ void refetchUsers() {
         && // not delinquent
         !doc["stripeCustomer"]["delinquent"].get_bool().value
       );
-      cout << " " << users[user].canPay;
+      cout << " " << acc.canPay;
+
+      // plan, used for quotas: explicit, or depending on ability to pay
+      acc.plan =
+        doc["plan"] && doc["plan"].type() == bsoncxx::type::k_string ?
+        (std::string)doc["plan"].get_string().value :
+        acc.canPay ? "paid" : "unpaid";
 
-      // get current month's metered usage per capability
+      // current month's metered usage per capability, see getOrgUsage
       if (doc["cap_usage"]) {
         for (auto &e : doc["cap_usage"].get_document().value) {
-          users[user].cap_usage[(std::string)e.key()] = e.get_int64().value;
-          cout << "\n " << e.key() << ": "
-          << users[user].cap_usage[(std::string)e.key()];
+          acc.cap_usage[(std::string)e.key()] = e.get_int64().value;
+          cout << "\n " << e.key() << ": " << e.get_int64().value;
         }
       }
 
       cout << endl;
     }
     cout << endl;
+    PROBE3(mongo_return, "find", "accounts", true);
+
+    table->quotaPolicy = fetchQuotas();
+    table->version = ++version;
+    accounts.publish(std::move(table), time(NULL));
 
   } catch (const mongocxx::v_noabi::query_exception& e) {
+    PROBE3(mongo_return, "find", "accounts", false);
     std::cerr << "ERROR: MongoDB query_exception: " << e.what() << std::endl;
   }
 }
 
 
-/** Record current meter readings in Mongo. */
-void recordMeterToMongo() {
-
-  cout << "recordMeterToMongo" << endl;
+/** Create meters for the shared totals that other processes created, so the
+flusher logs and records them too. */
+void adoptSharedMeters() {
+  if (sharedState.size() == adoptedSharedKeys) return;
+  adoptedSharedKeys = sharedState.size();
+  sharedState.forEach([](std::string_view key, SharedCounters::Slot &) {
+      // q/<org>/<capability>
+      size_t slash = key.find('/', 2);
+      if (!key.starts_with("q/") || slash == std::string_view::npos) return;
+      getMeter(key.substr(2, slash - 2), key.substr(slash + 1));
+    });
+}
 
-  auto now = std::chrono::system_clock::now();
-  std::time_t now_time_t = std::chrono::system_clock::to_time_t(now);
-  std::tm* now_tm = std::localtime(&now_time_t);
-  static int month = now_tm->tm_mon; // runs only once
+/** Write the totals of the meters that changed since the last call, or of
+all if asked to, to the usage log and commit them, as a group commit. When
+shared, those are the totals of all processes. */
+void logUsageTotals(bool all = false) {
+  if (sharedState.isFlusher()) {
+    adoptSharedMeters();
+  }
+  for (auto &entry : usage) {
+    org_usage &u = entry.second;
+    if (!u.loaded && !u.restored && (!accounts.get() || findAccount(u.id))) {
+      // not logged until they include what Mongo has, which the log replaces
+      continue;
+    }
+    for (auto &capUsage : u.cap_usage) {
+      long int &logged = u.cap_logged[capUsage.first];
+      long int current = capUsage.second.total();
+      // when shared, the totals may already be those of the next month; names
+      // too long for the log, or beyond its capacity, only go to Mongo
+      if (current > logged || (all && current > 0)) {
+        if (usageLog.isOpen()) {
+          usageLog.set(entry.first, capUsage.first, current);
+        }
+        logged = std::max(logged, current);
+      }
+    }
+  }
+  if (usageLog.isOpen()) {
+    usageLog.commit();
+  }
+}
 
-  // new month? if yes, reset usage
-  if (now_tm->tm_mon != month) { // can't use `>` because of new year
-    cout << "recordMeterToMongo: new month, resetting cap_usage" << endl;
+/** Open the usage log and replay it into the usage counters. */
+void replayUsageLog(const std::string &path) {
+  int currentMonth = usageMonth(time(NULL));
+  meterMonth = currentMonth;
+  usageLogPath = path;
+  if (sharedState.isOpen() && !sharedState.isFlusher()) {
+    // the flusher has it, see claimFlusher
+    return;
+  }
+  if (!usageLog.open(path)) {
+    std::cerr << "ERROR: unable to open usage log " << path
+    << ", usage since last recorded in Mongo will be lost on restart" << endl;
+    return;
+  }
 
-    for (auto it = users.begin(); it != users.end(); ++it) {
-      cout << " resetting " << it->first << endl;
-      it->second.cap_usage.clear();
-    }
-    month = now_tm->tm_mon;
+  syncUsage();
+  if (usageLog.month() == 0) {
+    usageLog.reset(currentMonth);
   }
+  // The log and Mongo may still hold a past month's usage, in which case
+  // recordMeterToMongo will roll over.
+  meterMonth = usageLog.month();
+
+  cout << "replaying " << usageLog.count() << " usage log totals for "
+  << meterMonth << endl;
+  usageLog.replay([](const std::string &org, const std::string &capability,
+      int64_t total) {
+      // The logged totals include what Mongo had, and are at least what we
+      // wrote there since: take the larger one, rather than adding them up
+      org_usage &u = getOrgUsage(org);
+      if (!u.loaded && !u.restored) {
+        u.restored = true;
+        firstToLoad(u.id); // so that no other process adds Mongo's either
+      }
+      meter &m = getCapMeter(u, capability);
+      if (total > m.total()) m.add(total - m.total());
+      long int &logged = u.cap_logged[capability];
+      logged = std::max(logged, total);
+    });
+}
 
-  for (auto it = users.cbegin(); it != users.cend(); ++it) {
+/** Write the given meter readings to Mongo. Blocking, runs on the worker.
+Returns whether all were recorded. */
+bool writeMetersToMongo(
+  const std::map<std::string, std::map<std::string, long int>> &meters) {
 
-    auto cap_usage = it->second.cap_usage;
+  bool recorded = true;
+  for (auto it = meters.cbegin(); it != meters.cend(); ++it) {
+
+    auto &cap_usage = it->second;
     auto meter = bsoncxx::builder::basic::document{};
     for (auto it2 = cap_usage.cbegin(); it2 != cap_usage.cend(); ++it2) {
       cout << "reads: " << it->first << ", " << it2->first << ": "
@@ -204,74 +619,197 @@ void recordMeterToMongo() {
       meter.append(kvp(it2->first, bsoncxx::types::b_int64{it2->second}));
     }
 
-    auto update_one_result = getAccountsCollection()
-        .update_one(make_document(kvp("_id", it->first)),
-        make_document(kvp("$set",
-          make_document(kvp("cap_usage", meter))
-        )));
+    try {
+      PROBE2(mongo_entry, "update_one", it->first.c_str());
+      auto update_one_result = getAccountsCollection()
+          .update_one(make_document(kvp("_id", it->first)),
+          make_document(kvp("$set",
+            make_document(kvp("cap_usage", meter))
+          )));
+      PROBE3(mongo_return, "update_one", it->first.c_str(), true);
+
+      if (update_one_result && update_one_result->modified_count() > 0){
+        cout << "updated mqtt usage for " << it->first << endl;
+      }
+    } catch (const std::exception& e) {
+      PROBE3(mongo_return, "update_one", it->first.c_str(), false);
+      std::cerr << "ERROR: recordMeterToMongo: " << e.what() << " "
+      << it->first << endl;
+      recorded = false;
+    }
+  }
+  return recorded;
+}
+
+/** Whether this process is the first to see the given month start, and hence
+to reset the shared totals */
+bool startSharedMonth(int month) {
+  SharedCounters::Slot *slot = sharedState.find("month");
+  if (!slot) return false;
+  int64_t seen = slot->value.load();
+  while (seen < month) {
+    if (slot->value.compare_exchange_weak(seen, month)) return true;
+  }
+  return false;
+}
+
+/** Record current meter readings in Mongo, on the worker. */
+void recordMeterToMongo(time_t now) {
+
+  cout << "recordMeterToMongo" << endl;
+
+  // new month? if yes, reset usage
+  int month = usageMonth(now);
+  if (month != meterMonth) {
+    cout << "recordMeterToMongo: new month, resetting cap_usage" << endl;
+
+    if (sharedState.isOpen() && startSharedMonth(month)) {
+      sharedState.forEach([](std::string_view key, SharedCounters::Slot &slot) {
+          if (key.starts_with("q/")) slot.value.store(0);
+        });
+    }
 
-    if (update_one_result->modified_count() > 0){
-      cout << "updated mqtt usage for " << it->first << endl;
+    for (auto it = usage.begin(); it != usage.end(); ++it) {
+      cout << " resetting " << it->first << endl;
+      for (auto &capUsage : it->second.cap_usage) {
+        capUsage.second.bytes = 0;
+        capUsage.second.overQuota = false;
+      }
+      for (auto &logged : it->second.cap_logged) {
+        logged.second = 0;
+      }
+    }
+    meterMonth = month;
+    if (usageLog.isOpen()) {
+      usageLog.reset(month);
     }
   }
+
+  if (sharedState.isOpen() && !sharedState.isFlusher()) {
+    // the flusher records the usage of all processes
+    return;
+  }
+
+  // what we write to Mongo is exactly what's logged, so replaying the log
+  // after a crash, before or after the write, yields the same totals
+  logUsageTotals();
+  auto meters =
+    std::make_shared<std::map<std::string, std::map<std::string, long int>>>();
+  for (auto it = usage.cbegin(); it != usage.cend(); ++it) {
+    (*meters)[it->first] = it->second.cap_logged;
+  }
+
+  worker.post("recordMeterToMongo",
+    [meters]() { writeMetersToMongo(*meters); });
 }
 
 
-// --------------------------------------------------------------------------
+/** Become the flusher of the shared usage if there is none (anymore). The
+shared totals already include what the previous flusher logged, so start the
+usage log afresh with them and record them in Mongo right away. */
+void claimFlusher(time_t now) {
+  if (sharedState.isFlusher() || !sharedState.claimFlusher()) return;
 
-/** Authenticate websocket users, verifying and matching the jwt token they
-provide as password against their username. */
-static int basic_auth_callback(int event, void *event_data, void *userdata) {
+  cout << "taking over as the flusher of shared usage" << endl;
+  adoptSharedMeters();
+  if (usageLog.isOpen() || usageLog.open(usageLogPath)) {
+    usageLog.reset(meterMonth);
+  } else {
+    std::cerr << "ERROR: unable to open usage log " << usageLogPath << endl;
+  }
+  logUsageTotals(true);
+  recordMeterToMongo(now);
+}
 
-	struct mosquitto_evt_basic_auth *ed = (mosquitto_evt_basic_auth *)event_data;
-	const char *username = mosquitto_client_username(ed->client);
-  const char *ip = mosquitto_client_address(ed->client);
-  const char *jwt_token = ed->password;
 
-	UNUSED(event);
-	UNUSED(userdata);
-  // cout << "basic auth check: " << username << endl;
+// --------------------------------------------------------------------------
 
-  if (!username || !jwt_token) {
-    return MOSQ_ERR_AUTH;
+/// Refetch accounts at most this often when an unknown user tries to connect
+const time_t onDemandRefetchInterval = 10; // seconds
+time_t lastOnDemandRefetch = 0;
+
+/// Rate limits on authentication attempts, see admission.hpp
+Admission admission;
+/// Attempts rejected by admission control since last logged, per decision
+uint64_t rejectedAuths[Admission::BACKOFF + 1] = {0};
+
+/** Log and reset the admission control counters, forget idle clients */
+void logAdmission(time_t now) {
+  if (rejectedAuths[Admission::IP_LIMITED] || rejectedAuths[Admission::ORG_LIMITED]
+    || rejectedAuths[Admission::GLOBAL_LIMITED] || rejectedAuths[Admission::BACKOFF]) {
+    printf("admission: rejected %lu by IP, %lu by org, %lu global, %lu backing off\n",
+      rejectedAuths[Admission::IP_LIMITED], rejectedAuths[Admission::ORG_LIMITED],
+      rejectedAuths[Admission::GLOBAL_LIMITED], rejectedAuths[Admission::BACKOFF]);
+    memset(rejectedAuths, 0, sizeof(rejectedAuths));
+  }
+  admission.prune(now);
+}
+
+/** Queue a refetch of the accounts, e.g., for an unknown user, at most every
+onDemandRefetchInterval. */
+void requestRefetch() {
+  if (scheduler.now() - lastOnDemandRefetch >= onDemandRefetchInterval) {
+    // maybe a new account; it can connect once the refetch is done
+    lastOnDemandRefetch = scheduler.now();
+    worker.post("refetchUsers", refetchUsers);
   }
+}
+
+/** Parse the username (json) into docObj; returns the id it claims, or an
+empty string if invalid. */
+static std::string parseUsername(const char *username,
+  picojson::object &docObj) {
 
-  // parse username (json)
   picojson::value doc;
   std::string err = picojson::parse(doc, username);
-  if (! err.empty()) {
+  if (! err.empty() || !doc.is<picojson::object>()) {
     std::cerr << "Can't parse username as JSON:" << err << endl;
-    return MOSQ_ERR_AUTH;
+    return "";
   }
-  picojson::object docObj = doc.get<picojson::object>();
+  docObj = doc.get<picojson::object>();
 
   if (!docObj["id"].is<std::string>()) {
     std::cerr << "Id missing from username" << endl;
-    return MOSQ_ERR_AUTH;
+    return "";
   }
+  return docObj["id"].get<std::string>();
+}
 
-  // make sure we have the JWT for this user
-  std::string name = docObj["id"].get<std::string>();
-  user u = users[name];
-  if (u.jwt_secret.empty()) {
-    refetchUsers();
-    u = users[name];
-  }
+/** Verify and match the jwt token against the parsed username of user `name`.
+When refreshing, i.e., re-authenticating, the token only needs to be for the
+same user, and its payload replaces the username's in docObj. Returns
+MOSQ_ERR_NOT_FOUND if we don't have a JWT secret for the user. Only uses the
+accounts snapshot, so it can run on any thread. */
+static int verifyToken(picojson::object &docObj, const std::string &name,
+  const char *jwt_token, const char *username, const char *ip, time_t now,
+  bool refresh = false) {
 
-  if (u.jwt_secret.empty()) {
+  // make sure we have the JWT for this user
+  const account *acc = findAccount(name);
+  if (!acc || acc->jwt_secret.empty()) {
     cout << "User has no JWT secret: " << name << endl;
-    return MOSQ_ERR_AUTH;
+    return MOSQ_ERR_NOT_FOUND;
   }
 
   auto verifier = jwt::verify()
-      .allow_algorithm(jwt::algorithm::hs256{u.jwt_secret});
+      .allow_algorithm(jwt::algorithm::hs256{acc->jwt_secret});
 
   try {
    	auto decoded = jwt::decode(jwt_token);
     verifier.verify(decoded);
 
+    if (refresh) {
+      // a new token, e.g., with a later expiry, replacing the username's
+      auto payload = decoded.get_payload_json();
+      if (!payload["id"].is<std::string>()
+        || payload["id"].get<std::string>() != name) {
+        cout << "WARN: refreshed JWT is for another user!" << endl;
+        return MOSQ_ERR_AUTH;
+      }
+      docObj["payload"] = picojson::value(payload);
+
     // Check that decoded.payload == username.payload
-    if (!docObj["payload"].is<picojson::object>() ||
+    } else if (!docObj["payload"].is<picojson::object>() ||
       decoded.get_payload_json() != docObj["payload"].get<picojson::object>()) {
       cout << "WARN: username payload and JWT payload don't match!"
       << endl;
@@ -279,11 +817,10 @@ static int basic_auth_callback(int event, void *event_data, void *userdata) {
     }
 
     // Verify that JWT is still valid
-    std::time_t currentTime = std::time(nullptr);
     auto payload = docObj["payload"].get<picojson::object>();
     if (!(payload["validity"].is<double>() && payload["iat"].is<double>() &&
         (payload["iat"].get<double>() + payload["validity"].get<double>())
-        > currentTime)) {
+        > now)) {
       cout << "WARN: JWT is expired! " << username << " " << ip << endl;
       return MOSQ_ERR_AUTH;
     }
@@ -313,198 +850,1111 @@ static int basic_auth_callback(int event, void *event_data, void *userdata) {
   return MOSQ_ERR_SUCCESS;
 }
 
+// A connection's token expiry
+struct token_expiry_struct {
+  std::string id; // the client id, to disconnect it by
+  time_t expires;
+};
 
-/* ---------------------------------------------------------------------------
-Rate limiting
-*/
+/// Token expiry per connection authenticated with a JWT
+std::unordered_map<struct mosquitto *, token_expiry_struct> tokenExpiries;
 
-#define THRESHOLD 200 // permitted requests per second before rate limiting
-#define BURST_THRESHOLD 2 * THRESHOLD // permitted bursts
+/** The time the token of the parsed username expires, 0 if unknown */
+time_t tokenExpiry(picojson::object &docObj) {
+  if (!docObj["payload"].is<picojson::object>()) return 0;
+  auto payload = docObj["payload"].get<picojson::object>();
+  if (!payload["validity"].is<double>() || !payload["iat"].is<double>()) {
+    return 0;
+  }
+  return payload["iat"].get<double>() + payload["validity"].get<double>();
+}
 
-// Structure to represent a client
-struct client_struct {
-  std::string id;   // Client username
-  std::string ip;   // The client IP
-  int count;        // Request count
-  bool isLimited;   // Whether the client is rate-limited
-  std::map<std::string, time_t> permissions; // Cached permissions for this client
-};
+/** Disconnect the client when its token expires, unless the connection is gone
+or has authenticated again by then */
+void expireToken(struct mosquitto *client, const char *id, time_t expires) {
+  if (!id || expires == 0) return;
+  tokenExpiries[client] = {id, expires};
+  timers.schedule(expires, [client, expires]() {
+      auto it = tokenExpiries.find(client);
+      if (it == tokenExpiries.end() || it->second.expires != expires) return;
+      std::string id = it->second.id;
+      tokenExpiries.erase(it);
+      printf("Token of %s expired, disconnecting\n", id.c_str());
+      PROBE1(token_expired, id.c_str());
+      mosquitto_kick_client_by_clientid(id.c_str(), false);
+    });
+}
 
-// Hash table of connected Clients
-std::map<std::string, client_struct> clients;
+/** Verify and match the jwt token provided as password against the username.
+Sets `checked` unless the attempt was shed by admission control or the user is
+unknown (yet), i.e., when a failure means the credentials are bad. */
+static int authenticate(struct mosquitto_evt_basic_auth *ed, bool &checked) {
 
-/** Add or update a client in the map */
-void add_or_update_client(const std::string &client_id, const std::string &ip) {
-  auto it = clients.find(client_id);
+	const char *username = mosquitto_client_username(ed->client);
+  const char *ip = mosquitto_client_address(ed->client);
+  const char *jwt_token = ed->password;
 
-  if (it == clients.end()) {
-    // Add new client
-    client_struct client{client_id, ip, 0, false, {}};
-    clients[client_id] = client;
-    printf("Adding client IP %s\n", ip.c_str());
-  } else {
-    // Update existing client
-    it->second.ip = ip;
+  // cout << "basic auth check: " << username << endl;
+
+  checked = true;
+  if (!username || !jwt_token) {
+    return MOSQ_ERR_AUTH;
   }
-}
 
-/** Remove client from rate limiting hash table */
-void remove_client(const std::string &client_id) {
-  auto it = clients.find(client_id);
-  if (it != clients.end()) {
-    clients.erase(it);
+  picojson::object docObj;
+  std::string name = parseUsername(username, docObj);
+  if (name.empty()) {
+    return MOSQ_ERR_AUTH;
   }
-}
 
-/** Add or remove the given client to/from the ipset */
-void update_ipset(const std::string &ip, bool add) {
-  printf("%s ipset 'limit' %s\n",
-         add ? "Adding IP to" : "Deleting IP from",
-         ip.c_str());
+  Admission::Decision decision = admission.admitOrg(name, scheduler.now());
+  if (decision != Admission::ADMITTED) {
+    rejectedAuths[decision]++;
+    checked = false;
+    return MOSQ_ERR_AUTH;
+  }
 
-  std::string cmd = "ipset " + std::string(add ? "add" : "del") + " limit " + ip;
-  printf("Running %s\n", cmd.c_str());
-  int status = system(cmd.c_str());
-  printf("Result: %d\n", status);
-  fflush(stdout);
+  int result = verifyToken(docObj, name, jwt_token, username, ip,
+    scheduler.now());
+  if (result == MOSQ_ERR_NOT_FOUND) {
+    requestRefetch();
+    checked = false;
+    return MOSQ_ERR_AUTH;
+  }
+  if (result == MOSQ_ERR_SUCCESS) {
+    expireToken(ed->client, mosquitto_client_id(ed->client),
+      tokenExpiry(docObj));
+  }
+  return result;
 }
 
-// Last time we ran counter-reduction
-time_t last_time = 0;
+/** Authenticate websocket users, unless admission control sheds them. */
+static int basic_auth_callback(int event, void *event_data, void *userdata) {
 
-/** Reduce all counters every time two or more seconds have passed */
-void reduce_write_counters() {
-  time_t current_time = time(NULL);
-  time_t time_diff = current_time - last_time;
+	struct mosquitto_evt_basic_auth *ed = (mosquitto_evt_basic_auth *)event_data;
+  const char *ip = mosquitto_client_address(ed->client);
+	const char *id = mosquitto_client_id(ed->client);
 
-  if (time_diff >= 2) {
-    for (auto &entry : clients) {
-      client_struct &client = entry.second;
+	UNUSED(event);
+  instance_struct *instance = (instance_struct *)userdata;
+  catchUp();
+  COUNT_ALLOCS(instance->basicAuthAllocs);
+  PROBE2(basic_auth_entry, id, ip);
 
-      if (client.count > 0) {
-        // printf("Reducing client counter %s (%s): %d\n",
-        //   client.id.c_str(), client.ip.c_str(), client.count);
+  if (!ip || !id) {
+    PROBE3(basic_auth_return, id, ip, MOSQ_ERR_AUTH);
+    return MOSQ_ERR_AUTH;
+  }
 
-        // Reduce all counters by THRESHOLD per second
-        client.count = std::max(client.count - THRESHOLD * static_cast<int>(time_diff), 0);
+  // clients behind the same IP back off independently
+  std::string client = std::string(ip) + " " + id;
+  time_t now = scheduler.now();
+  Admission::Decision decision = admission.admit(client, ip, now);
+  if (decision != Admission::ADMITTED) {
+    rejectedAuths[decision]++;
+    PROBE3(admission_rejected, id, ip, decision);
+    PROBE3(basic_auth_return, id, ip, MOSQ_ERR_AUTH);
+    return MOSQ_ERR_AUTH;
+  }
 
-        if (client.isLimited && client.count < THRESHOLD) {
-          // Client is behaving again; remove from rate-limiting ipset
-          update_ipset(client.ip, false);
-          client.isLimited = false;
-        }
-      }
-    }
-    last_time = current_time;
+  // only bad credentials make the client back off, not being shed
+  bool checked = false;
+  int result = authenticate(ed, checked);
+  if (checked) {
+    admission.result(client, result == MOSQ_ERR_SUCCESS, now);
   }
-  fflush(stdout);
+  PROBE3(basic_auth_return, id, ip, result);
+  return result;
 }
 
-/** Find the write-counter for this client/IP and update it */
-void update_write_counter(const std::string &client_id, const std::string &ip) {
-  auto it = clients.find(client_id);
 
-  if (it != clients.end()) {
-    client_struct &client = it->second;
-    client.count++;
+/* ---------------------------------------------------------------------------
+Extended authentication (MQTT v5): clients that connect with the auth method
+"transitive-jwt" and the JWT as auth data get verified on a pool of threads.
+Since mosquitto 2.0 expects an answer from the callback, we reply "pending"
+until the result is in, and the client sends another AUTH packet to ask again.
+*/
 
-    if (!client.isLimited && client.count > BURST_THRESHOLD) {
-      // Client is misbehaving; add to rate-limiting ipset
-      printf("Client %s (%s) has reached write rate limit: %d\n",
-             client.id.c_str(), client.ip.c_str(), client.count);
-      update_ipset(client.ip, true);
-      client.isLimited = true;
+#define EXT_AUTH_METHOD "transitive-jwt"
+const time_t extAuthTimeout = 30; // seconds
+const size_t maxQueuedVerifications = 1000;
+
+// An extended authentication in progress
+struct ext_auth_struct {
+  uint64_t request; // to match results to the current request
+  std::string id;   // the client id, in case the client struct got reused
+  std::string key;  // for admission control
+  time_t started;
+  int result = MOSQ_ERR_AUTH_CONTINUE; // until verified
+  std::shared_ptr<const Grant> grant; // when re-authenticating, once verified
+};
+
+std::map<struct mosquitto *, ext_auth_struct> extAuths;
+uint64_t extAuthRequests = 0;
+/// Threads verifying tokens for extended authentication, 0 to disable
+int verifierThreads = 2;
+Worker verifiers;
+
+/** Send data to the client in the AUTH packet answering this event */
+void setAuthData(struct mosquitto_evt_extended_auth *ed, const char *data) {
+  ed->data_out = mosquitto_strdup(data);
+  ed->data_out_len = ed->data_out ? strlen(data) : 0;
+}
+
+void refresh_grant(struct mosquitto *connection, const char *id,
+  std::shared_ptr<const Grant> grant, time_t now);
+
+/** Apply the result of a verification on the broker thread */
+void completeExtAuth(struct mosquitto *client, uint64_t request, int result,
+  const std::string &org, time_t expires, std::shared_ptr<const Grant> grant) {
+
+  auto it = extAuths.find(client);
+  if (it == extAuths.end() || it->second.request != request) {
+    return; // client gone or started over
+  }
+
+  time_t now = scheduler.now();
+  // only bad credentials make the client back off, not being shed
+  bool checked = true;
+  if (result == MOSQ_ERR_NOT_FOUND) {
+    requestRefetch();
+    result = MOSQ_ERR_AUTH;
+    checked = false;
+  }
+  if (result == MOSQ_ERR_SUCCESS) {
+    Admission::Decision decision = admission.admitOrg(org, now);
+    if (decision != Admission::ADMITTED) {
+      rejectedAuths[decision]++;
+      result = MOSQ_ERR_AUTH;
+      checked = false;
     }
-  } else {
-    add_or_update_client(client_id, ip);
   }
+  if (checked) {
+    admission.result(it->second.key, result == MOSQ_ERR_SUCCESS, now);
+  }
+  if (result == MOSQ_ERR_SUCCESS) {
+    expireToken(client, it->second.id.c_str(), expires);
+    if (grant) {
+      refresh_grant(client, it->second.id.c_str(), std::move(grant), now);
+      printf("Token of %s refreshed\n", it->second.id.c_str());
+      PROBE1(token_refreshed, it->second.id.c_str());
+    }
+  }
+  it->second.result = result;
 }
 
-/* -------------------------------------------------------------------------- */
+/** Start verifying the token given as auth data, on the verifier pool */
+static int ext_auth_start_callback(int event, void *event_data, void *userdata) {
 
+  struct mosquitto_evt_extended_auth *ed =
+    (mosquitto_evt_extended_auth *)event_data;
 
-/** The mosquitto ACL callback */
-static int acl_callback(int event, void *event_data, void *userdata) {
+  UNUSED(event);
+  instance_struct *instance = (instance_struct *)userdata;
+  catchUp();
+  COUNT_ALLOCS(instance->extAuthAllocs);
+
+  if (!ed->auth_method || strcmp(ed->auth_method, EXT_AUTH_METHOD) != 0) {
+    return MOSQ_ERR_PLUGIN_DEFER;
+  }
 
-	struct mosquitto_evt_acl_check *ed = (mosquitto_evt_acl_check *)event_data;
 	const char *username = mosquitto_client_username(ed->client);
+  const char *ip = mosquitto_client_address(ed->client);
 	const char *id = mosquitto_client_id(ed->client);
-	const char *ip = mosquitto_client_address(ed->client);
-
- 	UNUSED(event);
-	UNUSED(userdata);
-  bool output = false;
+  PROBE2(ext_auth_start, id, ip);
 
-  if (!ed->topic || !id || !username) {
-    return MOSQ_ERR_ACL_DENIED;
+  if (!username || !ip || !id || !ed->data_in || ed->data_in_len == 0) {
+    return MOSQ_ERR_AUTH;
   }
 
-  std::vector<std::string> topicParts = split(ed->topic, '/');
-
-  if (strcmp("$SYS/broker/uptime", ed->topic) == 0) {
-    // everyone is allowed to subscribe to the broker's heartbeat
-	  output && printf(": public\n");
-    return MOSQ_ERR_SUCCESS;
+  std::string key = std::string(ip) + " " + id;
+  time_t now = scheduler.now();
+  Admission::Decision decision = admission.admit(key, ip, now);
+  if (decision == Admission::ADMITTED
+    && verifiers.queued() >= maxQueuedVerifications) {
+    decision = Admission::GLOBAL_LIMITED;
   }
-
-  // is it a superuser?
-  if (prefix("transitiverobotics:", username)) {
-	  output && printf(": superuser\n");
-    return MOSQ_ERR_SUCCESS;
+  if (decision != Admission::ADMITTED) {
+    rejectedAuths[decision]++;
+    PROBE3(admission_rejected, id, ip, decision);
+    return MOSQ_ERR_AUTH;
   }
 
-  // meter reads and deny if over limit
-  if (ed->access == MOSQ_ACL_READ) {
-    // printf("read request for: %s %d\n", ed->topic, ed->payloadlen);
+  // connections authenticated with a token have an expiry; if it's them
+  // again, they are re-authenticating with a fresh token
+  bool refresh = tokenExpiries.contains(ed->client);
+  uint64_t request = ++extAuthRequests;
+  extAuths[ed->client] =
+    {request, id, key, now, MOSQ_ERR_AUTH_CONTINUE, nullptr};
+
+  struct mosquitto *client = ed->client;
+  // forget it if the client stops asking
+  timers.schedule(now + extAuthTimeout + 1, [client, request]() {
+      auto it = extAuths.find(client);
+      if (it != extAuths.end() && it->second.request == request) {
+        extAuths.erase(it);
+      }
+    });
+
+  std::string user = username, address = ip;
+  std::string token((const char *)ed->data_in, ed->data_in_len);
+  auto result = std::make_shared<int>(MOSQ_ERR_AUTH);
+  auto org = std::make_shared<std::string>();
+  auto expires = std::make_shared<time_t>(0);
+  auto grant = std::make_shared<std::shared_ptr<const Grant>>();
+
+  verifiers.post("", [user, address, token, now, refresh, result, org, expires,
+      grant]() {
+      picojson::object docObj;
+      *org = parseUsername(user.c_str(), docObj);
+      if (!org->empty()) {
+        *result = verifyToken(docObj, *org, token.c_str(), user.c_str(),
+          address.c_str(), now, refresh);
+        *expires = tokenExpiry(docObj);
+      }
+      if (refresh && *result == MOSQ_ERR_SUCCESS) {
+        // compile the new permissions here, off the broker thread
+        try {
+          *grant = std::make_shared<const Grant>(
+            compileGrant(picojson::value(docObj).serialize()));
+        } catch (const std::exception &e) {
+          std::cerr << "Can't compile refreshed token: " << e.what() << endl;
+          *result = MOSQ_ERR_AUTH;
+        }
+      }
+    }, [client, request, result, org, expires, grant]() {
+      completeExtAuth(client, request, *result, *org, *expires,
+        std::move(*grant));
+    });
 
-    if (topicParts[0][0] != '$') {
-      std::string user = topicParts[1];
-      std::string capability = topicParts[4];
-      users[user].cap_usage[capability] += ed->payloadlen;
+  setAuthData(ed, "pending");
+  return MOSQ_ERR_AUTH_CONTINUE;
+}
 
-      if (!users[user].canPay && users[user].cap_usage[capability] > maxBytes
-        // TODO: get list of limited capabilities from Mongo; for now just:
-        && capability == "ros-tool"
-        ) {
+/** Answer with the result of the verification, if it's in */
+static int ext_auth_continue_callback(int event, void *event_data,
+  void *userdata) {
 
-        // cout << "DENIED, " << user << ", " << capability << ": "
-        // << users[user].cap_usage[capability] << " exceeds " << maxBytes << endl;
-        printf("DENIED, %s %s: %ld exceeds %ld\n", user.c_str(), capability.c_str(),
-          users[user].cap_usage[capability], maxBytes);
-        return MOSQ_ERR_ACL_DENIED;
-      }
+  struct mosquitto_evt_extended_auth *ed =
+    (mosquitto_evt_extended_auth *)event_data;
+
+  UNUSED(event);
+  instance_struct *instance = (instance_struct *)userdata;
+  catchUp();
+  COUNT_ALLOCS(instance->extAuthAllocs);
+
+  if (!ed->auth_method || strcmp(ed->auth_method, EXT_AUTH_METHOD) != 0) {
+    return MOSQ_ERR_PLUGIN_DEFER;
+  }
+
+  verifiers.poll();
+  const char *id = mosquitto_client_id(ed->client);
+  auto it = extAuths.find(ed->client);
+  if (it == extAuths.end() || !id || it->second.id != id) {
+    return MOSQ_ERR_AUTH;
+  }
+
+  int result = it->second.result;
+  if (result == MOSQ_ERR_AUTH_CONTINUE) {
+    if (scheduler.now() - it->second.started <= extAuthTimeout) {
+      setAuthData(ed, "pending");
+      return MOSQ_ERR_AUTH_CONTINUE;
     }
+    result = MOSQ_ERR_AUTH;
   }
 
-  bool readAccess =
-    ed->access == MOSQ_ACL_READ || ed->access == MOSQ_ACL_SUBSCRIBE;
-  output && printf("%d, %s\n", readAccess, ed->topic);
+  extAuths.erase(it);
+  PROBE2(ext_auth_return, id, result);
+  return result;
+}
+
+/* ---------------------------------------------------------------------------
+Rate limiting
+*/
+
+#define THRESHOLD 200 // permitted requests per second before rate limiting
+#define BURST_THRESHOLD 2 * THRESHOLD // permitted bursts
+/// Bytes per second each client may publish, in bursts of twice that
+long int clientWriteRate = 10 * 1024 * 1024;
 
+// Memory budget per client for its cached permissions and subscriptions
+const size_t clientMemoryBudget = 256 * 1024;
+
+// A subscription filter a client was authorized for, and when
+struct subscription_struct {
+  std::pmr::string filter;
+  time_t authorized;
+};
+
+// Structure to represent a client
+struct client_struct {
+  Arena arena{clientMemoryBudget}; // everything below allocates from here
+  std::string id;   // Client username, or client id on a token connection
+  std::string username; // JSON username on a token connection
+  std::string ip;   // The client IP
+  int count = 0;    // Request count
+  shaper writeBudget; // bytes it may publish, see take_write_budget
+  time_t last = 0;  // When count last decayed, see decay_write_counter
+  bool isLimited = false; // Whether the client is rate-limited
+  uint64_t cacheHits = 0;   // permission cache hits and misses, and reads
+  uint64_t cacheMisses = 0; // allowed because of a subscription
+  uint64_t subscriptionHits = 0;
+  // Its token's permissions, see client_grant
+  std::shared_ptr<const Grant> grant;
+  // Cached permissions for this client
+  std::pmr::map<std::pmr::string, time_t, std::less<>> permissions{&arena};
+  TimerWheel::Id sweep = 0; // pending expiry of permissions, see sweep_cache
+  // Authorized subscriptions
+  std::pmr::vector<subscription_struct> subscriptions{&arena};
+};
+
+// Hash table of connected Clients
+std::map<std::string, client_struct, std::less<>> clients;
+
+// Clients authenticated by a token, by connection, so that each connection has
+// its own grant, cache, and arena
+std::unordered_map<struct mosquitto *, client_struct> connections;
+
+/** Forget the token client on this connection */
+void remove_connection(struct mosquitto *connection) {
+  auto it = connections.find(connection);
+  if (it != connections.end()) {
+    timers.cancel(it->second.sweep);
+    connections.erase(it);
+  }
+}
+
+/** The state of the token client on this connection, added on first use */
+client_struct &get_connection(struct mosquitto *connection, const char *id,
+  const char *username) {
+
+  auto it = connections.find(connection);
+  if (it != connections.end() && it->second.id != id) {
+    // the broker reused the memory of a connection we missed the end of
+    remove_connection(connection);
+    it = connections.end();
+  }
+  if (it == connections.end()) {
+    client_struct &client = connections[connection];
+    client.id = id;
+    client.username = username;
+    return client;
+  }
+  return it->second;
+}
+
+/** Add or update a client in the map */
+void add_or_update_client(const std::string &client_id, const std::string &ip) {
+  auto it = clients.find(client_id);
+
+  if (it == clients.end()) {
+    // Add new client
+    client_struct &client = clients[client_id];
+    client.id = client_id;
+    client.ip = ip;
+    printf("Adding client IP %s\n", ip.c_str());
+  } else {
+    // Update existing client
+    it->second.ip = ip;
+  }
+}
+
+/** Remember that the client was authorized to subscribe to filter */
+void add_subscription(client_struct &client, const char *filter, time_t now) {
+  for (auto &sub : client.subscriptions) {
+    if (sub.filter == filter) {
+      sub.authorized = now;
+      return;
+    }
+  }
+  client.subscriptions.push_back({std::pmr::string(filter, &client.arena), now});
+}
+
+/** Drop the expired permissions from the cache of the client on connection,
+and sweep again when the oldest of the rest expires. One timer per client,
+rather than per permission. */
+void sweep_cache(struct mosquitto *connection) {
+  auto it = connections.find(connection);
+  if (it == connections.end()) return;
+  client_struct &client = it->second;
+  client.sweep = 0;
+
+  time_t now = timers.now();
+  time_t oldest = now;
+  std::erase_if(client.permissions, [&](auto &cached) {
+      if (cached.second + cacheExpiration <= now) return true;
+      oldest = std::min(oldest, cached.second);
+      return false;
+    });
+  if (!client.permissions.empty()) {
+    client.sweep = timers.schedule(oldest + cacheExpiration,
+      [connection]() { sweep_cache(connection); });
+  }
+}
+
+/** Cache that the client on connection is permitted to access topic, until
+cacheExpiration. The cache is dropped when the client's arena is full. */
+void cache_permission(client_struct &client, struct mosquitto *connection,
+  const char *topic, time_t now) {
   try {
-    if (prefix("{", username)) {
-      // The username is a JSON string, from a websocket client
+    client.permissions.insert_or_assign(std::pmr::string(topic, &client.arena),
+      now);
+  } catch (const std::bad_alloc &e) {
+    printf("Permission cache of a client is full (%lu bytes), clearing it\n",
+      client.arena.size());
+    client.permissions.clear();
+    return;
+  }
+
+  if (!client.sweep) {
+    client.sweep = timers.schedule(now + cacheExpiration,
+      [connection]() { sweep_cache(connection); });
+  }
+}
+
+void remove_subscription(client_struct &client, const char *filter) {
+  std::erase_if(client.subscriptions,
+    [filter](auto &sub) { return sub.filter == filter; });
+}
+
+/** The permissions of the client's token: compiled from its username on first
+use, or those of the token it re-authenticated with since */
+const Grant &client_grant(client_struct &client, const char *username) {
+  if (!client.grant) {
+    client.grant = std::make_shared<const Grant>(compileGrant(username));
+  }
+  return *client.grant;
+}
+
+/** Whether the client's token grants access to topic */
+bool authorized(client_struct &client, const char *username,
+  std::string_view topic, bool readAccess, time_t now) {
+
+  PROBE2(isAuthorized_entry, username, readAccess);
+  bool result = grantAuthorized(client_grant(client, username), topic,
+    readAccess, now);
+  PROBE2(isAuthorized_return, username, result);
+  return result;
+}
+
+/** Swap in the permissions of the token a client re-authenticated with,
+keeping the cached permissions and subscriptions it still grants. Cached
+permissions are kept only if granted for writing, since the cache doesn't
+record the access they were for. */
+void refresh_grant(struct mosquitto *connection, const char *id,
+  std::shared_ptr<const Grant> grant, time_t now) {
+
+  const char *username = mosquitto_client_username(connection);
+  if (!username || !prefix("{", username)) return;
+  client_struct &client = get_connection(connection, id, username);
+
+  client.grant = std::move(grant);
+  const Grant &permitted = *client.grant;
+  std::erase_if(client.permissions, [&](auto &cached) {
+      return !grantAuthorized(permitted, cached.first, false, now);
+    });
+  std::erase_if(client.subscriptions, [&](auto &sub) {
+      return !grantAuthorized(permitted, sub.filter, true, now);
+    });
+}
 
-      std::time_t currentTime = std::time(nullptr);
+/** Whether topic is covered by one of the client's authorized subscriptions.
+Once their authorization expires, subscriptions are re-authorized here, since
+the broker won't ask again. */
+bool is_subscribed(client_struct &client, const char *username,
+  const char *topic, time_t now) {
 
-      // check cache
-      time_t cached = clients[username].permissions[ed->topic];
-      if (cached + cacheExpiration > currentTime ) {
-        // cache hit
-        return MOSQ_ERR_SUCCESS;
+  for (auto it = client.subscriptions.begin();
+    it != client.subscriptions.end(); ) {
+
+    if (!topicMatches(it->filter, topic)) {
+      ++it;
+      continue;
+    }
+    if (it->authorized + cacheExpiration > now) {
+      return true;
+    }
+    if (authorized(client, username, it->filter, true, now)) {
+      it->authorized = now;
+      return true;
+    }
+    it = client.subscriptions.erase(it);
+  }
+  return false;
+}
+
+/** Add or remove the given client to/from the ipset, on the worker */
+void update_ipset(const std::string &ip, bool add) {
+  printf("%s ipset 'limit' %s\n",
+         add ? "Adding IP to" : "Deleting IP from",
+         ip.c_str());
+
+  PROBE2(ipset, ip.c_str(), add);
+  std::string cmd = "ipset " + std::string(add ? "add" : "del") + " limit " + ip;
+  worker.post("", [cmd]() {
+      printf("Running %s\n", cmd.c_str());
+      int status = system(cmd.c_str());
+      printf("Result: %d\n", status);
+      fflush(stdout);
+    });
+}
+
+/** Reduce the client's counter by THRESHOLD per second since it last did */
+void decay_write_counter(client_struct &client, time_t now) {
+  if (now > client.last) {
+    client.count =
+      std::max(client.count - THRESHOLD * static_cast<int>(now - client.last), 0);
+    client.last = now;
+  }
+}
+
+/** Remove the client from the rate-limiting ipset once its counter will have
+decayed below THRESHOLD, or if it's gone by then */
+void schedule_cool_down(const std::string &client_id, const client_struct &client) {
+  time_t due = client.last + (client.count - THRESHOLD) / THRESHOLD + 1;
+  timers.schedule(due, [client_id, ip = client.ip]() {
+      auto it = clients.find(client_id);
+      if (it == clients.end()) {
+        update_ipset(ip, false);
+        return;
+      }
+      client_struct &client = it->second;
+      if (!client.isLimited) return;
+
+      decay_write_counter(client, timers.now());
+      if (client.count < THRESHOLD) {
+        // Client is behaving again; remove from rate-limiting ipset
+        update_ipset(client.ip, false);
+        client.isLimited = false;
+      } else {
+        schedule_cool_down(client_id, client);
       }
+    });
+}
 
-      if (isAuthorized(topicParts, username, readAccess)) {
-        // add to cache
-        clients[username].permissions[ed->topic] = currentTime;
-        return MOSQ_ERR_SUCCESS;
+/** Take the bytes of a publish from the client's write budget. Returns false,
+taking nothing, if they don't fit. */
+bool take_write_budget(client_struct &client, uint32_t bytes, time_t now) {
+  client.writeBudget.setRate(clientWriteRate, now);
+  client.writeBudget.refill(now);
+  if (!client.writeBudget.fits(bytes)) {
+    client.writeBudget.dropped++;
+    return false;
+  }
+  client.writeBudget.take(bytes);
+  return true;
+}
+
+/** Find the write-counter for this client/IP and update it. Returns the
+client, for taking the publish from its write budget once it's authorized. */
+client_struct &update_write_counter(const char *client_id, const char *ip,
+  time_t now) {
+
+  auto it = clients.find(std::string_view(client_id));
+
+  if (it != clients.end()) {
+    client_struct &client = it->second;
+    decay_write_counter(client, now);
+    client.count++;
+
+    if (!client.isLimited && client.count > BURST_THRESHOLD) {
+      // Client is misbehaving; add to rate-limiting ipset
+      printf("Client %s (%s) has reached write rate limit: %d\n",
+             client.id.c_str(), client.ip.c_str(), client.count);
+      update_ipset(client.ip, true);
+      client.isLimited = true;
+      schedule_cool_down(client_id, client);
+    }
+    return client;
+  } else {
+    add_or_update_client(client_id, ip);
+    return clients.find(std::string_view(client_id))->second;
+  }
+}
+
+/* ---------------------------------------------------------------------------
+Heavy hitters: the topics, clients, and orgs causing the most load
+*/
+
+const time_t heavyHittersInterval = 10; // seconds per sub-window
+HeavyHitters heavyTopics, heavyClients, heavyOrgs;
+
+/** Publish the given heavy hitters as JSON on $SYS/broker/transitive/heavy/<name> */
+void publishHeavyHitters(const char *name, const HeavyHitters &hitters) {
+  std::string json = "{\"window\":"
+    + std::to_string(heavyHittersInterval * HeavyHitters::WINDOWS);
+
+  for (bool byBytes : {false, true}) {
+    json += byBytes ? ",\"byBytes\":[" : ",\"byMessages\":[";
+    bool first = true;
+    for (auto &hitter : hitters.top(byBytes)) {
+      json += first ? "{\"key\":" : ",{\"key\":";
+      appendJsonString(json, hitter.key);
+      json += ",\"messages\":" + std::to_string(hitter.messages)
+        + ",\"bytes\":" + std::to_string(hitter.bytes) + "}";
+      first = false;
+    }
+    json += "]";
+  }
+  json += "}";
+
+  std::string topic = std::string("$SYS/broker/transitive/heavy/") + name;
+  mosquitto_broker_publish_copy(NULL, topic.c_str(), json.size(), json.c_str(),
+    0, false, NULL);
+}
+
+/** Count the message in the heavy hitter sketches */
+void trackHeavyHitters(const char *topic, const char *clientId,
+  uint32_t payloadlen) {
+
+  heavyTopics.add(topic, payloadlen);
+  heavyClients.add(clientId, payloadlen);
+  if (topic[0] == '/') {
+    const char *orgEnd = strchr(topic + 1, '/');
+    heavyOrgs.add(orgEnd ? std::string_view(topic + 1, orgEnd - topic - 1)
+      : std::string_view(topic + 1), payloadlen);
+  }
+}
+
+/** Publish the current top lists and advance the sliding windows */
+void rotateHeavyHitters() {
+  publishHeavyHitters("topics", heavyTopics);
+  publishHeavyHitters("clients", heavyClients);
+  publishHeavyHitters("orgs", heavyOrgs);
+  heavyTopics.rotate();
+  heavyClients.rotate();
+  heavyOrgs.rotate();
+}
+
+/* ---------------------------------------------------------------------------
+Usage summaries: each org's usage and quota state, as retained messages
+*/
+
+const time_t usagePublishInterval = 10; // seconds
+#define USAGE_TOPIC "/_fleet/" AGENT_CAP "/_usage"
+
+/** Whether topic is an org's usage summary. Delivering those is the plugin's
+own traffic, so it is neither metered nor shaped; otherwise it would change the
+very summary it delivers, which would then be republished forever. */
+bool isUsageSummary(std::string_view topic) {
+  return topicFrom(topic, 2) == std::string_view(USAGE_TOPIC).substr(1);
+}
+
+/** A cheap signature of the org's usage and quota state, to detect changes */
+uint64_t usageSignature(const org_usage &u) {
+  uint64_t signature = meterMonth;
+  for (auto &capUsage : u.cap_usage) {
+    signature = signature * 31 + capUsage.second.total();
+    signature = signature * 31 + capUsage.second.limit;
+    signature = signature * 31 + capUsage.second.overQuota;
+  }
+  return signature;
+}
+
+/** Compact JSON summary of the org's usage and quota state */
+std::string usageSummary(const org_usage &u) {
+  std::string json = "{\"month\":" + std::to_string(meterMonth) + ",\"plan\":";
+  appendJsonString(json, u.plan);
+  json += ",\"usage\":{";
+  bool first = true;
+  for (auto &capUsage : u.cap_usage) {
+    if (!first) json += ",";
+    appendJsonString(json, capUsage.first);
+    const meter &m = capUsage.second;
+    json += ":{\"bytes\":" + std::to_string(m.total()) + ",\"limit\":"
+      + (m.limit == UNLIMITED ? "null" : std::to_string(m.limit))
+      + ",\"overQuota\":" + (m.overQuota ? "true" : "false") + "}";
+    first = false;
+  }
+  json += "}}";
+  return json;
+}
+
+/** Publish the usage summary of each org whose usage changed, retained, on
+/<org>/_fleet/@transitive-robotics/_robot-agent/_usage, where the org's robots
+and fleet-wide JWTs can read it. */
+void publishUsage() {
+  for (auto &entry : usage) {
+    org_usage &u = entry.second;
+    if (u.cap_usage.empty() && u.published == 0) continue;
+
+    uint64_t signature = usageSignature(u);
+    if (signature == u.published) continue;
+
+    std::string json = usageSummary(u);
+    std::string topic = "/" + entry.first + USAGE_TOPIC;
+    mosquitto_broker_publish_copy(NULL, topic.c_str(), json.size(), json.c_str(),
+      0, true, NULL);
+    u.published = signature;
+  }
+}
+
+/* ---------------------------------------------------------------------------
+Control: introspection of the plugin's state, for superusers. Requests are
+published on $CONTROL/transitive/v1, like those of mosquitto's dynamic security
+plugin, e.g., {"commands":[{"command":"getClients","match":"org1"}]}. They are
+answered on the next tick, on $CONTROL/transitive/v1/response.
+*/
+
+#define CONTROL_TOPIC "$CONTROL/transitive/v1"
+const size_t maxControlRequests = 100; // queued at most
+const size_t maxControlResults = 20;   // clients per response
+const size_t maxControlEntries = 100;  // cache entries per client
+
+struct control_request {
+  std::string clientId;
+  std::string payload;
+};
+std::vector<control_request> controlRequests;
+
+/** JSON state of a client: limiter, cache, subscriptions, memory */
+std::string clientState(const std::string &key, const client_struct &client,
+  time_t now) {
+
+  std::string json = "{\"key\":";
+  appendJsonString(json, key);
+  json += ",\"id\":";
+  appendJsonString(json, client.id);
+  json += ",\"ip\":";
+  appendJsonString(json, client.ip);
+  json += ",\"writeCount\":" + std::to_string(client.count)
+    + ",\"isLimited\":" + (client.isLimited ? "true" : "false")
+    + ",\"writeBudget\":{\"rate\":" + (client.writeBudget.rate == UNLIMITED ?
+      "null" : std::to_string(client.writeBudget.rate))
+    + ",\"dropped\":" + std::to_string(client.writeBudget.dropped) + "}"
+    + ",\"memory\":" + std::to_string(client.arena.size())
+    + ",\"cache\":{\"hits\":" + std::to_string(client.cacheHits)
+    + ",\"misses\":" + std::to_string(client.cacheMisses)
+    + ",\"subscriptionHits\":" + std::to_string(client.subscriptionHits)
+    + ",\"size\":" + std::to_string(client.permissions.size())
+    + ",\"entries\":[";
+
+  size_t count = 0;
+  for (auto &permission : client.permissions) {
+    if (count++ == maxControlEntries) break;
+    json += count > 1 ? ",{\"topic\":" : "{\"topic\":";
+    appendJsonString(json, permission.first);
+    json += ",\"age\":" + std::to_string(now - permission.second) + "}";
+  }
+  json += "]},\"subscriptions\":[";
+  for (auto &sub : client.subscriptions) {
+    json += &sub == &client.subscriptions.front() ? "{\"filter\":" : ",{\"filter\":";
+    appendJsonString(json, sub.filter);
+    json += ",\"age\":" + std::to_string(now - sub.authorized) + "}";
+  }
+  json += "]}";
+  return json;
+}
+
+/** JSON state of an org's read rates and what they dropped */
+std::string shapingState(const org_usage &u) {
+  auto state = [](const shaper &s) {
+    return "{\"rate\":" + (s.rate == UNLIMITED ? "null" : std::to_string(s.rate))
+      + ",\"dropped\":" + std::to_string(s.dropped) + "}";
+  };
+  std::string json = "{\"org\":" + state(u.shaping) + ",\"capabilities\":{";
+  bool first = true;
+  for (auto &capUsage : u.cap_usage) {
+    if (!first) json += ",";
+    appendJsonString(json, capUsage.first);
+    json += ":" + state(capUsage.second.shaping);
+    first = false;
+  }
+  json += "}}";
+  return json;
+}
+
+/** JSON state of an org: account, usage, and shaping, without secrets */
+std::string orgState(const std::string &org) {
+  std::string json = "{\"org\":";
+  appendJsonString(json, org);
+  json += ",\"account\":";
+  const account *acc = findAccount(org);
+  if (acc) {
+    json += "{\"plan\":";
+    appendJsonString(json, acc->plan);
+    json += std::string(",\"canPay\":") + (acc->canPay ? "true" : "false")
+      + ",\"hasSecret\":" + (acc->jwt_secret.empty() ? "false" : "true") + "}";
+  } else {
+    json += "null";
+  }
+  auto it = usage.find(org);
+  json += ",\"usage\":" + (it == usage.end() ? "null" : usageSummary(it->second));
+  json += ",\"shaping\":" + (it == usage.end() ? "null" : shapingState(it->second));
+  json += "}";
+  return json;
+}
+
+/** JSON sizes of the plugin's tables */
+std::string memoryState() {
+  size_t clientMemory = 0, cacheEntries = 0;
+  for (auto &entry : clients) {
+    clientMemory += entry.second.arena.size();
+    cacheEntries += entry.second.permissions.size();
+  }
+  for (auto &entry : connections) {
+    clientMemory += entry.second.arena.size();
+    cacheEntries += entry.second.permissions.size();
+  }
+  size_t meters = 0;
+  for (auto &entry : usage) {
+    meters += entry.second.cap_usage.size();
+  }
+  const accounts_table *table = accounts.get();
+
+  return "{\"clients\":" + std::to_string(clients.size())
+    + ",\"connections\":" + std::to_string(connections.size())
+    + ",\"clientMemory\":" + std::to_string(clientMemory)
+    + ",\"cacheEntries\":" + std::to_string(cacheEntries)
+    + ",\"orgs\":" + std::to_string(usage.size())
+    + ",\"meters\":" + std::to_string(meters)
+    + ",\"accounts\":" + std::to_string(table ? table->byId.size() : 0)
+    + ",\"retiredSnapshots\":" + std::to_string(accounts.retiredCount())
+    + ",\"admissionEntries\":" + std::to_string(admission.size())
+    + ",\"timers\":" + std::to_string(timers.size())
+    + ",\"tokenExpiries\":" + std::to_string(tokenExpiries.size())
+    + ",\"usageLogMeters\":"
+    + std::to_string(usageLog.isOpen() ? usageLog.count() : 0)
+    + ",\"exportBatchesQueued\":" + std::to_string(usageExporter.queued())
+    + ",\"shared\":" + (!sharedState.isOpen() ? "null" :
+      "{\"keys\":" + std::to_string(sharedState.size())
+      + ",\"capacity\":" + std::to_string(sharedState.capacity())
+      + ",\"processes\":" + std::to_string(sharedState.processes())
+      + ",\"flusher\":" + (sharedState.isFlusher() ? "true" : "false") + "}")
+    + "}";
+}
+
+/** JSON heap allocations per instance and callback, null unless counted */
+std::string allocationsState() {
+  if (!allocsCounted) return "null";
+  std::string json = "[";
+  for (instance_struct *instance : instances) {
+    if (json.size() > 1) json += ",";
+    json += std::string("{\"listener\":\"")
+      + listenerModeNames[instance->mode] + "\"";
+    for (auto [name, stats] : {
+        std::pair<const char *, AllocStats &>{"acl", instance->aclAllocs},
+        {"basicAuth", instance->basicAuthAllocs},
+        {"extAuth", instance->extAuthAllocs},
+        {"disconnect", instance->disconnectAllocs},
+        {"tick", instance->tickAllocs},
+        {"control", instance->controlAllocs}}) {
+      json += std::string(",\"") + name + "\":{\"calls\":"
+        + std::to_string(stats.calls)
+        + ",\"allocations\":" + std::to_string(stats.allocations)
+        + ",\"bytes\":" + std::to_string(stats.bytes)
+        + ",\"maxAllocations\":" + std::to_string(stats.maxAllocations) + "}";
+    }
+    json += "}";
+  }
+  json += "]";
+  return json;
+}
+
+/** Run one control command, return its response object */
+std::string controlCommand(picojson::object &command, time_t now) {
+  std::string name = command["command"].is<std::string>() ?
+    command["command"].get<std::string>() : "";
+  std::string json = "{\"command\":";
+  appendJsonString(json, name);
+
+  if (name == "getClients" && command["match"].is<std::string>()) {
+    // clients whose key contains match
+    std::string match = command["match"].get<std::string>();
+    json += ",\"data\":[";
+    size_t count = 0;
+    auto add = [&](const std::string &key, const client_struct &client) {
+      if (key.find(match) == std::string::npos
+        || count == maxControlResults) return;
+      if (count++ > 0) json += ",";
+      json += clientState(key, client, now);
+    };
+    for (auto &entry : clients) add(entry.first, entry.second);
+    for (auto &entry : connections) add(entry.second.username, entry.second);
+    json += "]}";
+
+  } else if (name == "getOrg" && command["org"].is<std::string>()) {
+    json += ",\"data\":" + orgState(command["org"].get<std::string>()) + "}";
+
+  } else if (name == "getMemory") {
+    json += ",\"data\":" + memoryState() + "}";
+
+  } else if (name == "getAllocations") {
+    json += ",\"data\":" + allocationsState() + "}";
+
+  } else {
+    json += ",\"error\":\"Unknown command or missing argument\"}";
+  }
+  return json;
+}
+
+/** Answer the queued control requests */
+void answerControlRequests(time_t now) {
+  for (auto &request : controlRequests) {
+    std::string response = "{\"responses\":[";
+    picojson::value doc;
+    std::string err = picojson::parse(doc, request.payload);
+    picojson::object docObj;
+    if (err.empty() && doc.is<picojson::object>()) {
+      docObj = doc.get<picojson::object>();
+    }
+    if (docObj["commands"].is<picojson::array>()) {
+
+      bool first = true;
+      for (auto &command : docObj["commands"].get<picojson::array>()) {
+        if (!command.is<picojson::object>()) continue;
+        if (!first) response += ",";
+        response += controlCommand(command.get<picojson::object>(), now);
+        first = false;
       }
-      // std::cout << "DENIED: " << username << " " << ed->topic << std::endl;
+    } else {
+      response += "{\"error\":\"Invalid request\"}";
+    }
+    response += "]}";
 
-      // TODO: also cache disallowed clients, to avoid (unintentional) denial of
-      // service attacks when a client malfunctions; Maybe combine with caching
-      // validity of JWT instead of having a fixed cache expiration time?
-      return MOSQ_ERR_ACL_DENIED;
+    mosquitto_broker_publish_copy(request.clientId.c_str(),
+      CONTROL_TOPIC "/response", response.size(), response.c_str(), 0, false,
+      NULL);
+  }
+  controlRequests.clear();
+}
+
+/** Queue control requests from superusers, to be answered on the next tick */
+static int control_callback(int event, void *event_data, void *userdata) {
+
+  struct mosquitto_evt_control *ed = (mosquitto_evt_control *)event_data;
+	const char *username = mosquitto_client_username(ed->client);
+	const char *id = mosquitto_client_id(ed->client);
+
+  UNUSED(event);
+  instance_struct *instance = (instance_struct *)userdata;
+  COUNT_ALLOCS(instance->controlAllocs);
+
+  if (!username || !id || !prefix("transitiverobotics:", username)) {
+    return MOSQ_ERR_ACL_DENIED;
+  }
+  if (controlRequests.size() >= maxControlRequests) {
+    printf("Too many control requests, dropping one from %s\n", id);
+    return MOSQ_ERR_SUCCESS;
+  }
+
+  controlRequests.push_back({id,
+      std::string((const char *)ed->payload, ed->payloadlen)});
+  return MOSQ_ERR_SUCCESS;
+}
+
+/* ---------------------------------------------------------------------------
+Authorization policy
+*/
+
+/** Load the policy from the given JSON file, see policy.json. Returns an
+error, empty if there is none. */
+std::string loadPolicy(const std::string &path, Policy &policy) {
+  std::ifstream file(path);
+  if (!file) return "unable to read " + path;
+  std::stringstream contents;
+  contents << file.rdbuf();
+
+  picojson::value doc;
+  std::string err = picojson::parse(doc, contents.str());
+  if (!err.empty()) return err;
+  if (!doc.is<picojson::object>()) return "not an object";
+  auto &obj = doc.get<picojson::object>();
+
+  Policy loaded;
+  if (obj["public"].is<picojson::array>()) {
+    for (auto &topic : obj["public"].get<picojson::array>()) {
+      if (!topic.is<std::string>()) return "public topics must be strings";
+      loaded.addPublic(topic.get<std::string>());
     }
+  }
+
+  if (!obj["rules"].is<picojson::array>()) return "no rules";
+  for (auto &rule : obj["rules"].get<picojson::array>()) {
+    if (!rule.is<picojson::object>()) return "rules must be objects";
+    auto &ruleObj = rule.get<picojson::object>();
+    if (!ruleObj["subject"].is<std::string>()
+      || !ruleObj["when"].is<picojson::array>()) {
+      return "rules need a subject and a list of predicates (when)";
+    }
+
+    std::vector<std::string_view> when;
+    for (auto &predicate : ruleObj["when"].get<picojson::array>()) {
+      if (!predicate.is<std::string>()) return "predicates must be strings";
+      when.push_back(predicate.get<std::string>());
+    }
+    err = loaded.addRule(ruleObj["subject"].get<std::string>(), when);
+    if (!err.empty()) return err;
+  }
+
+  policy = std::move(loaded);
+  return "";
+}
+
+/* -------------------------------------------------------------------------- */
+
+
+/** Decide whether a client authenticated by a JWT, with a JSON username, may
+access the topic as requested: from its cache, its subscriptions, or else the
+policy */
+static int acl_check_token(struct mosquitto_evt_acl_check *ed,
+  const char *username, const char *id, bool readAccess) {
+
+  try {
+    std::time_t currentTime = scheduler.now();
+    client_struct &client = get_connection(ed->client, id, username);
+    // only authorized publishes count against the write budget
+    auto withinBudget = [&]() {
+        if (ed->access == MOSQ_ACL_WRITE
+          && !take_write_budget(client, ed->payloadlen, currentTime)) {
+          PROBE3(write_denied, id, ed->topic, ed->payloadlen);
+          return false;
+        }
+        return true;
+      };
+
+    // Messages are delivered because of a subscription. If that was
+    // authorized, so is any topic matching it, no need to check each one.
+    if (ed->access == MOSQ_ACL_READ
+      && is_subscribed(client, username, ed->topic, currentTime)) {
+      PROBE2(subscription_hit, id, ed->topic);
+      client.subscriptionHits++;
+      return MOSQ_ERR_SUCCESS;
+    }
+
+    if (ed->access == MOSQ_ACL_UNSUBSCRIBE) {
+      remove_subscription(client, ed->topic);
+    }
+
+    // check cache
+    auto cached = client.permissions.find(ed->topic);
+    if (cached != client.permissions.end()
+      && cached->second + cacheExpiration > currentTime ) {
+      // cache hit
+      PROBE3(permission_cache_hit, id, ed->topic, ed->access);
+      client.cacheHits++;
+      if (ed->access == MOSQ_ACL_SUBSCRIBE) {
+        add_subscription(client, ed->topic, currentTime);
+      }
+      return withinBudget() ? MOSQ_ERR_SUCCESS : MOSQ_ERR_ACL_DENIED;
+    }
+
+    PROBE3(permission_cache_miss, id, ed->topic, ed->access);
+    client.cacheMisses++;
+    if (authorized(client, username, ed->topic, readAccess, currentTime)) {
+      // add to cache
+      cache_permission(client, ed->client, ed->topic, currentTime);
+      if (ed->access == MOSQ_ACL_SUBSCRIBE) {
+        add_subscription(client, ed->topic, currentTime);
+      }
+      return withinBudget() ? MOSQ_ERR_SUCCESS : MOSQ_ERR_ACL_DENIED;
+    }
+    // std::cout << "DENIED: " << username << " " << ed->topic << std::endl;
+
+    // TODO: also cache disallowed clients, to avoid (unintentional) denial of
+    // service attacks when a client malfunctions; Maybe combine with caching
+    // validity of JWT instead of having a fixed cache expiration time?
+    return MOSQ_ERR_ACL_DENIED;
 
   } catch (const std::bad_alloc& e) {
     std::cerr << "bad_alloc: " << e.what() << " " << username << " "
@@ -523,99 +1973,150 @@ static int acl_callback(int event, void *event_data, void *userdata) {
 
     return MOSQ_ERR_ACL_DENIED;
   }
+}
 
+/** Decide whether a robot or capability, named by its certificate, may access
+the topic as requested. Never touches JSON or JWTs. */
+static int acl_check_certificate(struct mosquitto_evt_acl_check *ed,
+  const char *username, const char *ip, bool readAccess) {
 
-  if (ed->access == MOSQ_ACL_WRITE) {
-    reduce_write_counters();
-    update_write_counter(username, ip);
+  time_t now = scheduler.now();
+  client_struct *writer = ed->access == MOSQ_ACL_WRITE ?
+    &update_write_counter(username, ip, now) : nullptr;
 
-    // output = true;
-   	// printf("write request: %s %s %s", ed->topic, username, id);
-  // } else if (ed->access == MOSQ_ACL_SUBSCRIBE) {
-    // output = true;
-   	// printf("subscribe request: %s %s %s", ed->topic, username, id);
+  // does the user (cloud capability or robot) have access to this namespace?
+  if (!namespaceAuthorized(username, ed->topic, readAccess)) {
+	  printf(": DENIED (%s)\n", ip);
+    return MOSQ_ERR_ACL_DENIED;
   }
-  // not printing READ requests, because they are too verbose
 
-  // if (ed->access == MOSQ_ACL_READ) {
-  //   printf("read request for: %s %d\n", ed->topic, ed->payloadlen);
-  // }
+  // only authorized publishes count against the write budget
+  if (writer && !take_write_budget(*writer, ed->payloadlen, now)) {
+    PROBE3(write_denied, username, ed->topic, ed->payloadlen);
+    return MOSQ_ERR_ACL_DENIED;
+  }
+  return MOSQ_ERR_SUCCESS;
+}
 
-  char orgId[80], deviceId[80], scope[80], name[80];
-  int result = sscanf(ed->topic, "/%79[^/]/%79[^/]/%79[^/]/%79[^/]/",
-            orgId, deviceId, scope, name);
-  if (result != 4) {
-    printf("error parsing topic\n");
+/** Decide whether the client may access the topic as requested, on a listener
+with the given kind of clients */
+template<ListenerMode mode>
+static int acl_check(struct mosquitto_evt_acl_check *ed) {
+
+	const char *username = mosquitto_client_username(ed->client);
+	const char *id = mosquitto_client_id(ed->client);
+	const char *ip = mosquitto_client_address(ed->client);
+
+  bool output = false;
+
+  if (!ed->topic || !id || !username) {
     return MOSQ_ERR_ACL_DENIED;
   }
-  // printf("topic parts: %s %s %s %s\n", orgId, deviceId, scope, name);
 
-  // does the user have access to this topic?
-  if (prefix("cap:", username)) {
-    // it's a cloud capability: give access to cap's namespace
-    char user_scope[80], user_name[80];
-    if (sscanf(username + 4, "%79[^/]/%s", user_scope, user_name) != 2) {
-  	  printf(": DENIED (%s)\n", ip);
-      return MOSQ_ERR_ACL_DENIED;
-    }
-    if (strcmp(user_scope, scope) != 0 || strcmp(user_name, name) != 0) {
-  	  printf(": DENIED (%s)\n", ip);
-      return MOSQ_ERR_ACL_DENIED;
-    }
-	  output && printf(": capability namespace matches\n");
+  if (ed->access == MOSQ_ACL_READ || ed->access == MOSQ_ACL_WRITE) {
+    trackHeavyHitters(ed->topic, id, ed->payloadlen);
+  }
 
-  } else {
-    // it's a robot/device
+  if (authPolicy.isPublic(ed->topic)) {
+    // e.g., everyone is allowed to subscribe to the broker's heartbeat
+	  output && printf(": public\n");
+    return MOSQ_ERR_SUCCESS;
+  }
 
-    char user_orgId[80], user_deviceId[80];
-    if (sscanf(username, "%79[^:]:%s", user_orgId, user_deviceId) != 2) {
-  	  printf(": DENIED (%s)\n", ip);
-      return MOSQ_ERR_ACL_DENIED;
-    }
-    if (strcmp(user_orgId, orgId) != 0) {
-  	  printf(": DENIED (%s)\n", ip);
+  // is it a superuser?
+  if (prefix("transitiverobotics:", username)) {
+	  output && printf(": superuser\n");
+    return MOSQ_ERR_SUCCESS;
+  }
+
+  // reject oversized publishes before the broker stores and fans them out
+  if (ed->access == MOSQ_ACL_WRITE && ed->topic[0] != '$') {
+    auto levels = topicLevels<5>(ed->topic);
+    long int max = maxPayload(levels[4], topicFrom(ed->topic, 6));
+    if (ed->payloadlen > max) {
+      PROBE3(payload_denied, id, ed->topic, ed->payloadlen);
+      printf("DENIED, %s: payload of %u exceeds %ld on %s\n", id,
+        ed->payloadlen, max, ed->topic);
       return MOSQ_ERR_ACL_DENIED;
     }
+  }
 
-    // allow all robots read access to the /orgId/_fleet namespace
-    if (readAccess && strcmp("_fleet", deviceId) == 0) {
-      output && printf(": readonly access to _fleet namespace\n");
-      return MOSQ_ERR_SUCCESS;
-    }
+  // meter reads and deny if over limit or rate
+  if (ed->access == MOSQ_ACL_READ) {
+    // printf("read request for: %s %d\n", ed->topic, ed->payloadlen);
 
-    if (strcmp(user_deviceId, deviceId) != 0) {
-  	  printf(": DENIED (%s)\n", ip);
-      return MOSQ_ERR_ACL_DENIED;
+    if (ed->topic[0] != '$' && !isUsageSummary(ed->topic)) {
+      // without allocating, this runs for every message delivered
+      auto levels = topicLevels<5>(ed->topic);
+      std::string_view user = levels[1];
+      std::string_view capability = levels[4];
+      org_usage &orgUsage = getOrgUsage(user);
+      meter &usage = getCapMeter(orgUsage, capability);
+
+      // drop what exceeds the org's or capability's rate, but never messages
+      // the rest depends on, like the agent's status and commands
+      if (!unshaped.contains(capability, topicFrom(ed->topic, 6))
+        && !shape(orgUsage.shaping, usage.shaping, ed->payloadlen,
+          scheduler.now())) {
+        PROBE2(rate_denied, ed->topic, ed->payloadlen);
+        return MOSQ_ERR_ACL_DENIED;
+      }
+
+      bool overQuota = usage.add(ed->payloadlen);
+
+      if (overQuota) {
+        PROBE3(quota_denied, ed->topic, usage.bytes, usage.limit);
+        printf("DENIED, %.*s %.*s: %ld exceeds %ld\n",
+          (int)user.size(), user.data(), (int)capability.size(), capability.data(),
+          usage.bytes, usage.limit);
+        return MOSQ_ERR_ACL_DENIED;
+      }
+
+      usageExporter.record(ed->topic, ed->payloadlen, scheduler.now());
     }
-	  output && printf(": device namespace matches\n");
   }
 
-  // if we made it here, we are good
-  return MOSQ_ERR_SUCCESS;
+  bool readAccess =
+    ed->access == MOSQ_ACL_READ || ed->access == MOSQ_ACL_SUBSCRIBE;
+  output && printf("%d, %s\n", readAccess, ed->topic);
 
-	// switch(ed->access){
-	// 	case MOSQ_ACL_SUBSCRIBE:
-	// 		return acl_check(event_data, acl_check_subscribe, default_access.subscribe);
-	// 		break;
-	// 	case MOSQ_ACL_UNSUBSCRIBE:
-	// 		return acl_check(event_data, acl_check_unsubscribe, default_access.unsubscribe);
-	// 		break;
-	// 	case MOSQ_ACL_WRITE: /* Client to broker */
-	// 		return acl_check(event_data, acl_check_publish_c_send, default_access.publish_c_send);
-	// 		break;
-	// 	case MOSQ_ACL_READ:
-	// 		return acl_check(event_data, acl_check_publish_c_recv, default_access.publish_c_recv);
-	// 		break;
-	// 	default:
-	// 		return MOSQ_ERR_PLUGIN_DEFER;
-	// }
-	// return MOSQ_ERR_PLUGIN_DEFER;
+  if constexpr (mode == MTLS_LISTENER) {
+    return acl_check_certificate(ed, username, ip, readAccess);
+  } else if constexpr (mode == WEBSOCKET_LISTENER) {
+    return prefix("{", username)
+      ? acl_check_token(ed, username, id, readAccess) : MOSQ_ERR_ACL_DENIED;
+  } else {
+    return prefix("{", username)
+      ? acl_check_token(ed, username, id, readAccess)
+      : acl_check_certificate(ed, username, ip, readAccess);
+  }
+}
+
+/** The mosquitto ACL callback, for the given kind of listener */
+template<ListenerMode mode>
+static int acl_callback(int event, void *event_data, void *userdata) {
+
+	struct mosquitto_evt_acl_check *ed = (mosquitto_evt_acl_check *)event_data;
+
+ 	UNUSED(event);
+  instance_struct *instance = (instance_struct *)userdata;
+
+  catchUp();
+  COUNT_ALLOCS(instance->aclAllocs);
+  PROBE3(acl_entry, mosquitto_client_id(ed->client), ed->topic, ed->access);
+  int result = acl_check<mode>(ed);
+  PROBE4(acl_return, mosquitto_client_id(ed->client), ed->topic, ed->access,
+    result);
+  return result;
 }
 
 /** Clean up hash tables when client disconnects */
 static int on_disconnect_callback(int event, void *event_data, void *userdata) {
 
 	struct mosquitto_evt_disconnect *ed = (mosquitto_evt_disconnect *)event_data;
+  instance_struct *instance = (instance_struct *)userdata;
+  catchUp();
+  COUNT_ALLOCS(instance->disconnectAllocs);
 	const char *username = mosquitto_client_username(ed->client);
 	const char *id = mosquitto_client_id(ed->client);
 	const char *ip = mosquitto_client_address(ed->client);
@@ -623,10 +2124,50 @@ static int on_disconnect_callback(int event, void *event_data, void *userdata) {
   // cout << "Client disconnected: " << id << " " << ip << endl;
   printf("Client disconnected: %s %s %s\n", id, username, ip);
 
-  if (id && prefix("{", username)) {
-    remove_client(username);
+  if (instance->mode != MTLS_LISTENER) {
+    remove_connection(ed->client);
+    extAuths.erase(ed->client);
+    tokenExpiries.erase(ed->client);
+  }
+
+  return MOSQ_ERR_SUCCESS;
+}
+
+
+/** Run due background work, and apply results from the workers */
+void runBackground(time_t now) {
+  lastBackgroundRun = now;
+  worker.poll();
+  verifiers.poll();
+  scheduler.tick(now, tickBudget);
+  timers.advance(scheduler.now());
+}
+
+/** Without tick events, run the background work from the other callbacks
+instead, at most once a second. They come often enough on a busy broker, and
+on an idle one there is little to do. Since this runs on every callback, it
+reads the coarse wall clock, which the kernel only updates on its own tick
+and the vDSO returns without reading the clock hardware; a few milliseconds
+of lag don't matter for once a second. */
+void catchUp() {
+  if (ticking) return;
+  struct timespec clock;
+  clock_gettime(CLOCK_REALTIME_COARSE, &clock);
+  time_t now = clock.tv_sec;
+  if (now > lastBackgroundRun) {
+    runBackground(now);
   }
+}
+
+/** The tick event, from mosquitto's main loop: run due background work */
+static int tick_callback(int event, void *event_data, void *userdata) {
+  UNUSED(event);
+  UNUSED(event_data);
+  instance_struct *instance = (instance_struct *)userdata;
+  COUNT_ALLOCS(instance->tickAllocs);
 
+  ticking = true;
+  runBackground(time(NULL));
   return MOSQ_ERR_SUCCESS;
 }
 
@@ -645,16 +2186,28 @@ int mosquitto_plugin_version(int supported_version_count,
 }
 
 
-int mosquitto_plugin_init(mosquitto_plugin_id_t *identifier, void **user_data,
-  struct mosquitto_opt *opts, int opt_count) {
-
-	UNUSED(user_data);
-	// UNUSED(opts);
-	// UNUSED(opt_count);
+/** Set up the state shared by all instances, with the options of the first */
+void initProcess(struct mosquitto_opt *opts, int opt_count) {
+
+  std::string sharedName = getOption(opts, opt_count, "shared_state", "");
+  if (!sharedName.empty()) {
+    size_t slots = std::stoul(getOption(opts, opt_count, "shared_slots",
+        "65536"));
+    if (sharedState.open(sharedName, slots)) {
+      if (sharedState.created()) sharedState.claimFlusher();
+      cout << "shared state " << sharedName << ": " << sharedState.processes()
+      << " processes, " << sharedState.size() << " keys"
+      << (sharedState.isFlusher() ? ", flusher" : "") << endl;
+    } else {
+      std::cerr << "ERROR: unable to open shared state " << sharedName << ": "
+      << strerror(errno) << ", limits will be per process" << endl;
+    }
+  }
 
-  printf("init\n");
-  // flush all `ipset`s
-  system("ipset flush");
+  // flush all `ipset`s, unless other broker processes are using them
+  if (!sharedState.isOpen() || sharedState.created()) {
+    system("ipset flush");
+  }
 
   // example code for getting opts and env vars
   // printf("init message plugin, %d %s\n", opt_count, getenv("TR_BILLING_SERVICE"));
@@ -662,33 +2215,178 @@ int mosquitto_plugin_init(mosquitto_plugin_id_t *identifier, void **user_data,
   //   printf("option: %s = %s\n", opts[i].key, opts[i].value);
   // }
 
+  std::string policyPath = getOption(opts, opt_count, "policy");
+  if (!policyPath.empty()) {
+    std::string err = loadPolicy(policyPath, authPolicy);
+    if (err.empty()) {
+      cout << "policy " << policyPath << ": " << authPolicy.rules() << " rules"
+      << endl;
+    } else {
+      std::cerr << "ERROR: unable to load policy " << policyPath << ": " << err
+      << ", using the built-in one" << endl;
+    }
+  }
+
   refetchUsers();
+  replayUsageLog(getOption(opts, opt_count, "usage_log",
+      "/persistence/usage.log"));
+
+  UsageExporter::Config exportConfig;
+  exportConfig.host = getOption(opts, opt_count, "clickhouse_host");
+  exportConfig.port = std::stoi(getOption(opts, opt_count, "clickhouse_port",
+      "8123"));
+  const char *clickhouseUser = getenv("CLICKHOUSE_USER");
+  const char *clickhousePassword = getenv("CLICKHOUSE_PASSWORD");
+  exportConfig.user = getOption(opts, opt_count, "clickhouse_user",
+    clickhouseUser ? clickhouseUser : "default");
+  exportConfig.password = getOption(opts, opt_count, "clickhouse_password",
+    clickhousePassword ? clickhousePassword : "");
+  exportConfig.spoolPath = getOption(opts, opt_count, "clickhouse_spool",
+    exportConfig.spoolPath);
+  usageExporter.configure(exportConfig);
+
+  // background work on the broker thread
+  scheduler.every("syncUsage", 1, [](time_t) { syncUsage(); });
+  scheduler.every("commitUsage", usageCommitInterval,
+    [](time_t) { logUsageTotals(); });
+  scheduler.every("heavyHitters", heavyHittersInterval,
+    [](time_t) { rotateHeavyHitters(); });
+  scheduler.every("usageExport", 1,
+    [](time_t now) { usageExporter.rotate(now); });
+  scheduler.every("usagePublish", usagePublishInterval,
+    [](time_t) { publishUsage(); });
+  scheduler.every("recordMeterToMongo", 3600, recordMeterToMongo);
+  scheduler.every("admission", 10, logAdmission);
+  scheduler.every("control", 1, answerControlRequests);
+
+  // blocking I/O, on the worker
+  scheduler.every("refetchUsers", 300,
+    [](time_t) { worker.post("refetchUsers", refetchUsers); });
+  scheduler.every("usageExportFlush", 10,
+    [](time_t) { worker.post("usageExportFlush", []() { usageExporter.flush(); }); });
+  if (sharedState.isOpen()) {
+    scheduler.every("sharedFlusher", 10, claimFlusher);
+  }
+  worker.start();
+
+  clientWriteRate = std::stol(getOption(opts, opt_count, "client_write_rate",
+      std::to_string(clientWriteRate)));
+  if (clientWriteRate <= 0) clientWriteRate = UNLIMITED;
 
-	mosq_pid = identifier;
-  int acl_result = mosquitto_callback_register(mosq_pid, MOSQ_EVT_ACL_CHECK, acl_callback,
-    NULL, NULL);
+  unshaped.set(getOption(opts, opt_count, "unshaped", "_robot-agent"));
 
-  int auth_result = mosquitto_callback_register(mosq_pid, MOSQ_EVT_BASIC_AUTH,
-    basic_auth_callback, NULL, NULL);
+  verifierThreads = std::stoi(getOption(opts, opt_count, "auth_threads",
+      std::to_string(verifierThreads)));
+  if (verifierThreads > 0) {
+    verifiers.start(verifierThreads);
+  }
+}
 
-  int disconnect_result = mosquitto_callback_register(mosq_pid, MOSQ_EVT_DISCONNECT,
-    on_disconnect_callback, NULL, NULL);
+/** Tear down the state shared by all instances, after the last one */
+void cleanupProcess() {
+  // let the workers finish what they are doing and apply the results
+  verifiers.stop();
+  worker.stop();
+  worker.poll();
+
+  logUsageTotals();
+  usageLog.close();
+  sharedState.close();
+  usageExporter.shutdown(time(NULL));
+}
 
-  // set up cron jobs
-  interval(recordMeterToMongo, 3600000);
-  interval(refetchUsers, 300000);
+int mosquitto_plugin_init(mosquitto_plugin_id_t *identifier, void **user_data,
+  struct mosquitto_opt *opts, int opt_count) {
 
-  return acl_result | auth_result | disconnect_result;
+  printf("init\n");
+
+  instance_struct *instance = new instance_struct;
+  instance->pid = identifier;
+  std::string mode = getOption(opts, opt_count, "listener", "any");
+  if (mode == "mtls") {
+    instance->mode = MTLS_LISTENER;
+    instance->acl = acl_callback<MTLS_LISTENER>;
+  } else if (mode == "websockets") {
+    instance->mode = WEBSOCKET_LISTENER;
+    instance->acl = acl_callback<WEBSOCKET_LISTENER>;
+  } else if (mode == "any") {
+    instance->acl = acl_callback<ANY_LISTENER>;
+  } else {
+    std::cerr << "ERROR: unknown listener " << mode
+    << ", expected mtls, websockets, or any" << endl;
+    delete instance;
+    return MOSQ_ERR_INVAL;
+  }
+
+  if (instances.empty()) {
+    initProcess(opts, opt_count);
+    instance->control = true;
+  }
+  // robots and capabilities authenticate with their certificate
+  instance->extAuth = instance->mode != MTLS_LISTENER && verifierThreads > 0;
+  instances.push_back(instance);
+  *user_data = instance;
+  cout << "listener " << listenerModeNames[instance->mode] << ", instance "
+  << instances.size() << endl;
+
+  int result =
+    mosquitto_callback_register(identifier, MOSQ_EVT_ACL_CHECK, instance->acl,
+      NULL, instance)
+    | mosquitto_callback_register(identifier, MOSQ_EVT_DISCONNECT,
+      on_disconnect_callback, NULL, instance)
+    | mosquitto_callback_register(identifier, MOSQ_EVT_TICK, tick_callback,
+      NULL, instance);
+
+  if (instance->mode != MTLS_LISTENER) {
+    result |= mosquitto_callback_register(identifier, MOSQ_EVT_BASIC_AUTH,
+      basic_auth_callback, NULL, instance);
+  }
+  if (instance->control) {
+    result |= mosquitto_callback_register(identifier, MOSQ_EVT_CONTROL,
+      control_callback, CONTROL_TOPIC, instance);
+  }
+  if (instance->extAuth) {
+    result |= mosquitto_callback_register(identifier, MOSQ_EVT_EXT_AUTH_START,
+        ext_auth_start_callback, EXT_AUTH_METHOD, instance)
+      | mosquitto_callback_register(identifier, MOSQ_EVT_EXT_AUTH_CONTINUE,
+        ext_auth_continue_callback, EXT_AUTH_METHOD, instance);
+  }
+  return result;
 }
 
 
 int mosquitto_plugin_cleanup(void *user_data, struct mosquitto_opt *opts,
   int opt_count) {
 
-	UNUSED(user_data);
 	UNUSED(opts);
 	UNUSED(opt_count);
 
-	return mosquitto_callback_unregister(mosq_pid, MOSQ_EVT_ACL_CHECK,
-    acl_callback, NULL);
+  instance_struct *instance = (instance_struct *)user_data;
+  mosquitto_plugin_id_t *pid = instance->pid;
+  int result =
+    mosquitto_callback_unregister(pid, MOSQ_EVT_ACL_CHECK, instance->acl, NULL)
+    | mosquitto_callback_unregister(pid, MOSQ_EVT_DISCONNECT,
+      on_disconnect_callback, NULL)
+    | mosquitto_callback_unregister(pid, MOSQ_EVT_TICK, tick_callback, NULL);
+  if (instance->mode != MTLS_LISTENER) {
+    result |= mosquitto_callback_unregister(pid, MOSQ_EVT_BASIC_AUTH,
+      basic_auth_callback, NULL);
+  }
+  if (instance->control) {
+    result |= mosquitto_callback_unregister(pid, MOSQ_EVT_CONTROL,
+      control_callback, CONTROL_TOPIC);
+  }
+  if (instance->extAuth) {
+    result |= mosquitto_callback_unregister(pid, MOSQ_EVT_EXT_AUTH_START,
+      ext_auth_start_callback, EXT_AUTH_METHOD)
+    | mosquitto_callback_unregister(pid, MOSQ_EVT_EXT_AUTH_CONTINUE,
+      ext_auth_continue_callback, EXT_AUTH_METHOD);
+  }
+
+  std::erase(instances, instance);
+  delete instance;
+  if (instances.empty()) {
+    cleanupProcess();
+  }
+  return result;
 }
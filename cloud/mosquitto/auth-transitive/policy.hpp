@@ -0,0 +1,250 @@
+
+#include <time.h>
+
+#include <algorithm>
+#include <array>
+#include <bitset>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/* ----------------------------------------------------------------------------
+* Authorization policy
+*
+* Which subject may access which topic is decided by rules. The rules are
+* loaded from a JSON file at init (plugin_opt_policy, see policy.json) or are
+* the defaults below. A rule applies to one kind of subject and names the
+* predicates that must hold, or, prefixed with `!`, must not. Rules are compiled
+* into a decision table with one entry for each combination of predicates. A
+* check then computes the request's predicate bits and looks up the entry, so
+* more rules don't mean more work per check.
+*
+* Uses topicLevels and topicFrom from topics.hpp.
+*/
+
+/** The kinds of subjects: websocket clients authenticated by a JWT in their
+username, robots (`org:device`), and cloud capabilities (`cap:@scope/name`) */
+enum PolicySubject { TOKEN, ROBOT, CAPABILITY, SUBJECTS };
+
+/** What may or may not hold for a request */
+enum Predicate : uint16_t {
+  READ_ACCESS = 1 << 0,          // reading: subscribing or receiving
+  VALID = 1 << 1,                // credentials are current, e.g., JWT not expired
+  ORG_MATCH = 1 << 2,            // the topic is in the subject's org
+  DEVICE_MATCH = 1 << 3,         // ... for the subject's device
+  CAP_MATCH = 1 << 4,            // ... for the subject's capability
+  AGENT_PERMISSION = 1 << 5,     // the subject is permitted the robot-agent
+  AGENT_REQUESTED = 1 << 6,      // the topic is the robot-agent's
+  FLEET_PERMISSION = 1 << 7,     // the subject is permitted the whole fleet
+  FLEET_REQUESTED = 1 << 8,      // the topic is the fleet's, /org/_fleet/..
+  TOPIC_ALLOWED = 1 << 9,        // the sub-topic is in the permitted topics
+  NO_TOPIC_CONSTRAINTS = 1 << 10 // no topics permitted means all are
+};
+
+class Policy {
+
+  static const int PREDICATES = 11;
+
+  static constexpr std::array<std::pair<std::string_view, Predicate>,
+    PREDICATES> predicateNames{{
+      {"readAccess", READ_ACCESS},
+      {"valid", VALID},
+      {"orgMatch", ORG_MATCH},
+      {"deviceMatch", DEVICE_MATCH},
+      {"capMatch", CAP_MATCH},
+      {"agentPermission", AGENT_PERMISSION},
+      {"agentRequested", AGENT_REQUESTED},
+      {"fleetPermission", FLEET_PERMISSION},
+      {"fleetRequested", FLEET_REQUESTED},
+      {"topicAllowed", TOPIC_ALLOWED},
+      {"noTopicConstraints", NO_TOPIC_CONSTRAINTS}
+    }};
+
+  static constexpr std::array<std::string_view, SUBJECTS> subjectNames{
+    "token", "robot", "capability"};
+
+  std::array<std::bitset<1 << PREDICATES>, SUBJECTS> table;
+  std::vector<std::string> publicTopics;
+  size_t ruleCount = 0;
+
+public:
+
+  /** Add a rule allowing access to the given kind of subject when all the named
+  predicates hold. Returns an error, empty if there is none. */
+  std::string addRule(std::string_view subject,
+    const std::vector<std::string_view> &when) {
+
+    size_t s = 0;
+    while (s < SUBJECTS && subjectNames[s] != subject) s++;
+    if (s == SUBJECTS) return "unknown subject: " + std::string(subject);
+
+    uint16_t required = 0;
+    uint16_t excluded = 0;
+    for (std::string_view name : when) {
+      bool negated = name.starts_with("!");
+      if (negated) name.remove_prefix(1);
+      size_t p = 0;
+      while (p < PREDICATES && predicateNames[p].first != name) p++;
+      if (p == PREDICATES) return "unknown predicate: " + std::string(name);
+      (negated ? excluded : required) |= predicateNames[p].second;
+    }
+    if (required & excluded) return "contradicting predicates";
+
+    for (uint32_t bits = 0; bits < table[s].size(); bits++) {
+      if ((bits & required) == required && (bits & excluded) == 0) {
+        table[s].set(bits);
+      }
+    }
+    ruleCount++;
+    return "";
+  }
+
+  /** Allow everyone access to the given topic */
+  void addPublic(std::string topic) {
+    publicTopics.push_back(std::move(topic));
+  }
+
+  /** Whether the policy allows the given subject access, for a request with the
+  given predicates */
+  bool allows(PolicySubject subject, uint16_t predicates) const {
+    return table[subject][predicates];
+  }
+
+  bool isPublic(std::string_view topic) const {
+    for (auto &publicTopic : publicTopics) {
+      if (publicTopic == topic) return true;
+    }
+    return false;
+  }
+
+  size_t rules() const { return ruleCount; }
+
+  /** The built-in policy; policy.json spells out the same */
+  static Policy defaults() {
+    Policy policy;
+    policy.addPublic("$SYS/broker/uptime"); // the broker's heartbeat
+
+    // a device's capability, optionally limited to some of its topics;
+    // robot-agent permissions grant access to the whole device
+    policy.addRule("token",
+      {"valid", "orgMatch", "deviceMatch", "capMatch", "topicAllowed"});
+    policy.addRule("token",
+      {"valid", "orgMatch", "deviceMatch", "agentPermission", "topicAllowed"});
+    // all tokens for a device grant read access to its robot-agent
+    policy.addRule("token",
+      {"valid", "orgMatch", "deviceMatch", "readAccess", "agentRequested"});
+    // _fleet tokens grant read access to all devices' robot-agents, and
+    // access to the capability (or everything for the robot-agent) on all
+    // devices in the org
+    policy.addRule("token", {"valid", "orgMatch", "fleetPermission",
+        "readAccess", "agentRequested", "noTopicConstraints"});
+    policy.addRule("token", {"valid", "orgMatch", "fleetPermission",
+        "capMatch", "noTopicConstraints"});
+    policy.addRule("token", {"valid", "orgMatch", "fleetPermission",
+        "agentPermission", "noTopicConstraints"});
+
+    // robots may access their own namespace, and read their fleet's
+    policy.addRule("robot", {"orgMatch", "deviceMatch"});
+    policy.addRule("robot", {"orgMatch", "fleetRequested", "readAccess"});
+
+    // cloud capabilities may access their namespace on all devices
+    policy.addRule("capability", {"capMatch"});
+    return policy;
+  }
+};
+
+/// The policy in effect
+inline Policy authPolicy = Policy::defaults();
+
+/** The permissions a JWT grants, compiled from its payload, see compileGrant */
+struct Grant {
+  std::string org;        // the id, if the username's and payload's agree
+  std::string device;     // or _fleet
+  std::string capability; // @scope/name
+  bool topicConstraints = false; // whether limited to the topics below
+  std::vector<std::string> topics; // prefixes of sub-topics
+  time_t expires = 0;     // iat + validity, 0 if either is missing
+};
+
+/** Whether the policy grants a client with the given token access to topic,
+/org/device/@scope/name/version/sub-topic. Does not allocate. */
+inline bool grantAuthorized(const Grant &grant, std::string_view topic,
+  bool readAccess, time_t now, const Policy &policy = authPolicy) {
+
+  auto levels = topicLevels<5>(topic);
+  if (!levels[0].empty() || std::count(topic.begin(), topic.end(), '/') < 4) {
+    return false;
+  }
+  std::string_view org = levels[1];
+  std::string_view device = levels[2];
+  // the sub-topic, all levels after the version
+  std::string_view sub = topicFrom(topic, 6);
+
+  // the capability, @scope/name, is contiguous in topic
+  std::string_view capability =
+    topic.substr(levels[3].data() - topic.data(),
+      levels[3].size() + 1 + levels[4].size());
+
+  bool topicAllowed = !grant.topicConstraints;
+  for (auto &prefix : grant.topics) {
+    topicAllowed = topicAllowed || sub.starts_with(prefix);
+  }
+
+  uint16_t predicates =
+    (readAccess ? READ_ACCESS : 0)
+    | (grant.expires > now ? VALID : 0)
+    | (!grant.org.empty() && grant.org == org ? ORG_MATCH : 0)
+    | (grant.device == device ? DEVICE_MATCH : 0)
+    | (grant.capability == capability ? CAP_MATCH : 0)
+    | (grant.capability == "@transitive-robotics/_robot-agent"
+      ? AGENT_PERMISSION : 0)
+    | (levels[3] == "@transitive-robotics" && levels[4] == "_robot-agent"
+      ? AGENT_REQUESTED : 0)
+    | (grant.device == "_fleet" ? FLEET_PERMISSION : 0)
+    | (device == "_fleet" ? FLEET_REQUESTED : 0)
+    | (!grant.topicConstraints ? NO_TOPIC_CONSTRAINTS : 0)
+    | (topicAllowed ? TOPIC_ALLOWED : 0);
+
+  return policy.allows(TOKEN, predicates);
+}
+
+/** Whether the given username of a robot (`org:device`) or cloud capability
+(`cap:@scope/name`) is allowed access to topic, /org/device/@scope/name/..
+Does not allocate. */
+inline bool namespaceAuthorized(std::string_view username,
+  std::string_view topic, bool readAccess, const Policy &policy = authPolicy) {
+
+  auto levels = topicLevels<5>(topic);
+  // /org/device/@scope/name
+  if (!levels[0].empty() || levels[1].empty() || levels[2].empty()
+    || levels[3].empty() || levels[4].empty()) {
+    return false;
+  }
+
+  uint16_t predicates = VALID // the broker checked their credentials
+    | (readAccess ? READ_ACCESS : 0)
+    | (levels[2] == "_fleet" ? FLEET_REQUESTED : 0)
+    | (levels[4] == "_robot-agent" && levels[3] == "@transitive-robotics"
+      ? AGENT_REQUESTED : 0);
+
+  if (username.starts_with("cap:")) {
+    username.remove_prefix(4);
+    size_t slash = username.find('/');
+    if (slash != std::string_view::npos
+      && username.substr(0, slash) == levels[3]
+      && username.substr(slash + 1) == levels[4]) {
+      predicates |= CAP_MATCH;
+    }
+    return policy.allows(CAPABILITY, predicates);
+  }
+
+  size_t colon = username.find(':');
+  if (colon == std::string_view::npos || colon == 0
+    || colon + 1 == username.size()) {
+    return false;
+  }
+  if (username.substr(0, colon) == levels[1]) predicates |= ORG_MATCH;
+  if (username.substr(colon + 1) == levels[2]) predicates |= DEVICE_MATCH;
+  return policy.allows(ROBOT, predicates);
+}
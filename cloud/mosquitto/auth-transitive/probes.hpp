@@ -0,0 +1,38 @@
+
+/* ----------------------------------------------------------------------------
+* Tracing probes
+*
+* Statically defined (USDT) probes under the provider `transitive`, for use with
+* bpftrace or perf, e.g.:
+*
+*   bpftrace -e 'usdt:/mosquitto/mosquitto_auth_transitive.so:transitive:acl_return
+*     { @[arg3] = count(); }'
+*
+* A disabled probe is a single nop. Probes need systemtap's <sys/sdt.h>, which
+* the Dockerfile installs; the image build fails without it, so that a broker
+* can't silently ship without them. Define TRANSITIVE_NO_PROBES to compile them
+* to nothing instead, as compile.sh and compile_tests.sh do when it's missing.
+*/
+
+#if defined(TRANSITIVE_NO_PROBES)
+
+#define PROBE(name) do {} while (0)
+#define PROBE1(name, a) do {} while (0)
+#define PROBE2(name, a, b) do {} while (0)
+#define PROBE3(name, a, b, c) do {} while (0)
+#define PROBE4(name, a, b, c, d) do {} while (0)
+
+#elif __has_include(<sys/sdt.h>)
+
+#include <sys/sdt.h>
+#define PROBE(name) DTRACE_PROBE(transitive, name)
+#define PROBE1(name, a) DTRACE_PROBE1(transitive, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(transitive, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(transitive, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(transitive, name, a, b, c, d)
+
+#else
+
+#error "<sys/sdt.h> not found: install systemtap's sdt.h, see the Dockerfile, or define TRANSITIVE_NO_PROBES to build without probes"
+
+#endif
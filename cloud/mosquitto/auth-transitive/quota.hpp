@@ -0,0 +1,268 @@
+
+#include <time.h>
+
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <map>
+#include <vector>
+
+/* ----------------------------------------------------------------------------
+* Quotas
+*
+* Monthly read quotas per capability and plan. Each (org, capability) meter
+* holds the limit that applies to it and a precomputed over-quota flag, so the
+* per-message check doesn't need to consult the policy.
+*
+* Read rates, in bytes per second, are shaped per capability and per org (the
+* capability `*`) and plan, using lazily refilled byte buckets. Some classes of
+* messages are never shaped, see Unshaped.
+*
+* Publishes are limited in size per capability and topic class, the longest
+* matching prefix of the sub-topic (or `*` for any). Capabilities without
+* limits of their own get the default ones, by topic class too.
+*
+* Meters and buckets can keep their state in atomics shared with other broker
+* processes instead, see sharedState.hpp.
+*/
+
+const long int UNLIMITED = LONG_MAX;
+
+/** Quota definitions: byte limit and rate per capability and plan, and the
+maximum payload per capability and topic class */
+class QuotaPolicy {
+  typedef std::map<std::string, long int, std::less<>> Row;
+  typedef std::map<std::string, Row, std::less<>> Table;
+  Table limits, rates, payloads;
+  Row defaultPayloads; // by topic class, for capabilities not in payloads
+
+  static long int get(const Table &table, std::string_view capability,
+    std::string_view plan) {
+    auto cap = table.find(capability);
+    if (cap == table.end()) return UNLIMITED;
+    auto it = cap->second.find(plan);
+    return it == cap->second.end() ? UNLIMITED : it->second;
+  }
+
+public:
+  void set(const std::string &capability, const std::string &plan,
+    long int bytes) {
+    limits[capability][plan] = bytes;
+  }
+
+  void setRate(const std::string &capability, const std::string &plan,
+    long int bytesPerSecond) {
+    rates[capability][plan] = bytesPerSecond;
+  }
+
+  void setMaxPayload(const std::string &capability,
+    const std::string &topicClass, long int bytes) {
+    payloads[capability][topicClass] = bytes;
+  }
+
+  /** Set the payload limit of capabilities that have none of their own */
+  void setDefaultMaxPayload(const std::string &topicClass, long int bytes) {
+    defaultPayloads[topicClass] = bytes;
+  }
+
+  /** The limit for the given capability and plan, UNLIMITED if none */
+  long int limit(std::string_view capability, std::string_view plan) const {
+    return get(limits, capability, plan);
+  }
+
+  /** The read rate for the given capability (`*` for the whole org) and
+  plan, UNLIMITED if none */
+  long int rate(std::string_view capability, std::string_view plan) const {
+    return get(rates, capability, plan);
+  }
+
+  /** The largest payload the capability may publish on the given sub-topic:
+  that of the longest topic class prefixing it, UNLIMITED if none. Does not
+  allocate. */
+  long int maxPayload(std::string_view capability, std::string_view sub) const {
+    auto cap = payloads.find(capability);
+    const Row &classes = cap == payloads.end() ? defaultPayloads : cap->second;
+
+    long int max = UNLIMITED;
+    size_t longest = 0;
+    for (auto &[topicClass, bytes] : classes) {
+      if (topicClass == "*") {
+        if (longest == 0) max = bytes;
+      } else if (sub.starts_with(topicClass) && topicClass.size() > longest) {
+        max = bytes;
+        longest = topicClass.size();
+      }
+    }
+    return max;
+  }
+
+  bool empty() const { return limits.empty() && rates.empty(); }
+};
+
+/** Byte rate limit: a bucket refilled lazily, when used */
+typedef struct shaper_struct {
+  static const int BURST_SECONDS = 2; // how much unused rate may accrue
+
+  long int rate = UNLIMITED; // bytes per second
+  long int tokens = 0;       // may go negative, see fits
+  time_t last = 0;
+  uint64_t dropped = 0;      // messages that didn't fit
+  // tokens and last, when shared, see share
+  std::atomic<int64_t> *sharedTokens = NULL;
+  std::atomic<int64_t> *sharedLast = NULL;
+
+  long int burst() const { return rate * BURST_SECONDS; }
+
+  /** Keep tokens and time of last refill in the given atomics instead */
+  void share(std::atomic<int64_t> *tokens, std::atomic<int64_t> *last,
+    time_t now) {
+    sharedTokens = tokens;
+    sharedLast = last;
+    initShared(now);
+  }
+
+  /** Fill a shared bucket that no one has used yet */
+  void initShared(time_t now) {
+    int64_t never = 0;
+    if (rate != UNLIMITED && sharedLast->compare_exchange_strong(never, now)) {
+      sharedTokens->store(burst());
+    }
+  }
+
+  void refill(time_t now) {
+    if (rate == UNLIMITED) return;
+    if (sharedTokens) {
+      // only the one who moves last forward adds the tokens for that time
+      int64_t before = sharedLast->load();
+      if (now <= before || !sharedLast->compare_exchange_strong(before, now)) {
+        return;
+      }
+      int64_t current = sharedTokens->load();
+      while (!sharedTokens->compare_exchange_weak(current,
+          std::min<int64_t>(burst(), current + (now - before) * rate)));
+      return;
+    }
+    if (now <= last) return;
+    tokens = std::min(burst(), tokens + (now - last) * rate);
+    last = now;
+  }
+
+  /** Whether a message of the given size may pass. Messages larger than the
+  burst pass when the bucket is full, and leave it in debt. */
+  bool fits(uint32_t bytes) const {
+    if (rate == UNLIMITED) return true;
+    long int available = sharedTokens ? sharedTokens->load() : tokens;
+    return available >= (long int)bytes || available >= burst();
+  }
+
+  void take(uint32_t bytes) {
+    if (rate == UNLIMITED) return;
+    if (sharedTokens) {
+      sharedTokens->fetch_sub(bytes);
+    } else {
+      tokens -= bytes;
+    }
+  }
+
+  void setRate(long int newRate, time_t now) {
+    if (newRate == rate) return;
+    rate = newRate;
+    if (sharedTokens) {
+      // other processes are using it, just make sure it's initialized
+      initShared(now);
+      return;
+    }
+    tokens = rate == UNLIMITED ? 0 : burst();
+    last = now;
+  }
+} shaper;
+
+/** Whether a message of the given size fits into both buckets; if so it is
+taken from both, otherwise counted as dropped. */
+inline bool shape(shaper &a, shaper &b, uint32_t bytes, time_t now) {
+  a.refill(now);
+  b.refill(now);
+  if (!a.fits(bytes)) {
+    a.dropped++;
+    return false;
+  }
+  if (!b.fits(bytes)) {
+    b.dropped++;
+    return false;
+  }
+  a.take(bytes);
+  b.take(bytes);
+  return true;
+}
+
+/** The classes of messages whose reads are never shaped, e.g., the agent's
+status that the rest depends on. Each class is a capability, optionally
+followed by a prefix of the sub-topic: `_robot-agent` or `ros-tool/_status`. */
+class Unshaped {
+  struct messageClass {
+    std::string capability;
+    std::string prefix; // of the sub-topic, empty for all
+  };
+  std::vector<messageClass> classes;
+
+public:
+
+  /** Set the classes from a space-separated list */
+  void set(std::string_view list) {
+    classes.clear();
+    while (!list.empty()) {
+      size_t end = list.find(' ');
+      std::string_view item = list.substr(0, end);
+      list.remove_prefix(end == std::string_view::npos ? list.size() : end + 1);
+      if (item.empty()) continue;
+      size_t slash = item.find('/');
+      if (slash == std::string_view::npos) {
+        classes.push_back({std::string(item), ""});
+      } else {
+        classes.push_back({std::string(item.substr(0, slash)),
+            std::string(item.substr(slash + 1))});
+      }
+    }
+  }
+
+  /** Whether messages of capability on this sub-topic are never shaped */
+  bool contains(std::string_view capability, std::string_view subTopic) const {
+    for (auto &c : classes) {
+      if (c.capability == capability && subTopic.starts_with(c.prefix)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  size_t size() const { return classes.size(); }
+};
+
+/** Usage of a capability by an org this month, and its quota state */
+typedef struct meter_struct {
+  long int bytes = 0;
+  long int limit = UNLIMITED;
+  bool overQuota = false;
+  shaper shaping; // read rate of this capability
+  std::atomic<int64_t> *shared = NULL; // total bytes of all processes, if any
+
+  /** Count the given bytes; returns whether the quota is now exceeded. */
+  bool add(long int n) {
+    bytes = shared ? shared->fetch_add(n) + n : bytes + n;
+    overQuota = bytes > limit;
+    return overQuota;
+  }
+
+  /** Bytes counted, by all processes when shared */
+  long int total() const {
+    return shared ? shared->load() : bytes;
+  }
+
+  void setLimit(long int newLimit) {
+    limit = newLimit;
+    overQuota = bytes > limit;
+  }
+} meter;
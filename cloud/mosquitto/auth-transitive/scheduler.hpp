@@ -0,0 +1,174 @@
+
+#include <time.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* ----------------------------------------------------------------------------
+* Scheduling
+*
+* Background work on the broker thread runs from mosquitto's tick event, in
+* bounded time slices, and the scheduler keeps a coarse clock so the per-message
+* path doesn't need to call time(). Blocking I/O runs on worker threads owned by
+* the plugin, which hand results back to the broker thread to be applied on the
+* next tick.
+*/
+
+class Scheduler {
+
+  struct Task {
+    std::string name;
+    time_t period;
+    time_t due;
+    std::function<void(time_t now)> run;
+  };
+
+  std::vector<Task> tasks;
+  size_t next = 0; // where to continue when the last tick ran out of time
+  time_t current;
+
+public:
+
+  Scheduler() : current(time(NULL)) {}
+
+  /** The time as of the last tick */
+  time_t now() const { return current; }
+
+  /** Run the given task every period seconds, starting after one period */
+  void every(const std::string &name, time_t period,
+    std::function<void(time_t now)> run) {
+    tasks.push_back({name, period, current + period, run});
+  }
+
+  /** Advance the clock and run the tasks that are due, round-robin, until the
+  budget is used up. Returns the number of tasks run. */
+  int tick(time_t now, std::chrono::microseconds budget) {
+    current = now;
+    auto start = std::chrono::steady_clock::now();
+    int ran = 0;
+
+    for (size_t i = 0; i < tasks.size(); i++) {
+      if (ran > 0 && std::chrono::steady_clock::now() - start > budget) break;
+
+      Task &task = tasks[next];
+      next = (next + 1) % tasks.size();
+      if (task.due > now) continue;
+
+      task.due = now + task.period;
+      task.run(now);
+      ran++;
+    }
+    return ran;
+  }
+};
+
+class Worker {
+
+  struct Job {
+    std::string name;
+    std::function<void()> run;
+    std::function<void()> done;
+  };
+
+  std::vector<std::thread> threads;
+  std::mutex mutex;
+  std::condition_variable wakeup;
+  bool stopping = false;
+  std::deque<Job> jobs;
+  std::deque<Job> completed; // whose done is yet to run on the owner thread
+  std::set<std::string> pending; // names of queued, running, or incomplete jobs
+
+  void loop() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      wakeup.wait(lock, [this]() { return stopping || !jobs.empty(); });
+      if (stopping) return;
+
+      Job job = std::move(jobs.front());
+      jobs.pop_front();
+      lock.unlock();
+      job.run();
+      lock.lock();
+
+      if (job.done) {
+        completed.push_back(std::move(job));
+      } else {
+        pending.erase(job.name);
+      }
+    }
+  }
+
+public:
+
+  ~Worker() {
+    stop();
+  }
+
+  /** Start the given number of threads; jobs run in order on one thread, and
+  concurrently on several. */
+  void start(int count = 1) {
+    stopping = false;
+    for (int i = 0; i < count; i++) {
+      threads.emplace_back([this]() { loop(); });
+    }
+  }
+
+  /** Run job on a worker thread, and then done on the owner thread when it
+  calls poll. Named jobs are skipped while one of the same name is pending.
+  Returns whether the job was queued. */
+  bool post(const std::string &name, std::function<void()> job,
+    std::function<void()> done = nullptr) {
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (stopping || (!name.empty() && !pending.insert(name).second)) {
+      return false;
+    }
+    jobs.push_back({name, job, done});
+    wakeup.notify_one();
+    return true;
+  }
+
+  /** Run the done functions of completed jobs, on the calling thread */
+  int poll() {
+    std::deque<Job> done;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      done.swap(completed);
+    }
+    for (auto &job : done) {
+      job.done();
+    }
+    if (!done.empty()) {
+      std::lock_guard<std::mutex> lock(mutex);
+      for (auto &job : done) pending.erase(job.name);
+    }
+    return done.size();
+  }
+
+  /** Let the current jobs finish, drop queued ones, and join the threads. */
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+      jobs.clear();
+    }
+    wakeup.notify_all();
+    for (auto &thread : threads) {
+      thread.join();
+    }
+    threads.clear();
+  }
+
+  /** Number of jobs waiting for a thread */
+  size_t queued() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return jobs.size();
+  }
+};
@@ -0,0 +1,210 @@
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <thread>
+
+/* ----------------------------------------------------------------------------
+* Shared state
+*
+* Counters shared by several broker processes on one host, e.g., behind
+* SO_REUSEPORT, so that between them they enforce one quota and one read rate
+* per org. They live in a named POSIX shared-memory segment, as a fixed-size,
+* open-addressing hash table that is only ever added to: inserts claim a slot
+* with a compare-and-swap, values are atomics, no locks.
+*
+* One of the processes is the designated flusher that records usage. When it
+* goes away, another one takes over, see claimFlusher.
+*/
+
+class SharedCounters {
+
+public:
+  static const size_t KEY_SIZE = 112;
+
+  struct Slot {
+    std::atomic<uint64_t> state; // EMPTY, CLAIMED, or the key's hash | READY
+    char key[KEY_SIZE];
+    std::atomic<int64_t> value;
+    std::atomic<int64_t> stamp;  // e.g., time of a bucket's last refill
+  };
+
+private:
+  static const uint64_t MAGIC = 0x7472616e73697401;
+  static const uint64_t EMPTY = 0;
+  static const uint64_t CLAIMED = 1;
+  static const uint64_t READY = 1ull << 63;
+
+  struct Header {
+    std::atomic<uint64_t> magic; // set by the creator once initialized
+    uint64_t capacity;
+    std::atomic<int> attached;   // processes using the segment
+    std::atomic<pid_t> flusher;
+    std::atomic<uint64_t> keys;  // inserted so far
+  };
+
+  std::string name;
+  Header *header = NULL;
+  Slot *slots = NULL;
+  size_t bytes = 0;
+  bool fresh = false;
+
+  static uint64_t hash(std::string_view key) {
+    return std::hash<std::string_view>{}(key) | READY;
+  }
+
+public:
+
+  ~SharedCounters() {
+    close();
+  }
+
+  /** Create or attach to the segment of the given name (e.g., /transitive),
+  with room for capacity keys. Returns whether that worked. */
+  bool open(const std::string &name, size_t capacity) {
+    bytes = sizeof(Header) + capacity * sizeof(Slot);
+
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    fresh = fd >= 0;
+    if (fresh) {
+      if (ftruncate(fd, bytes) != 0) {
+        ::close(fd);
+        shm_unlink(name.c_str());
+        return false;
+      }
+    } else {
+      if (errno != EEXIST) return false;
+      fd = shm_open(name.c_str(), O_RDWR, 0600);
+      if (fd < 0) return false;
+      // wait for the creator to size it
+      struct stat st;
+      for (int i = 0; i < 1000 && fstat(fd, &st) == 0 && st.st_size == 0; i++) {
+        std::this_thread::yield();
+      }
+      if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(Header)) {
+        ::close(fd);
+        return false;
+      }
+      bytes = st.st_size;
+    }
+
+    void *p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED) return false;
+
+    header = (Header *)p;
+    slots = (Slot *)((char *)p + sizeof(Header));
+    if (fresh) {
+      // ftruncate zero-filled it, i.e., all slots are empty
+      header->capacity = capacity;
+      header->magic.store(MAGIC, std::memory_order_release);
+    } else {
+      for (int i = 0; i < 1000 &&
+        header->magic.load(std::memory_order_acquire) != MAGIC; i++) {
+        std::this_thread::yield();
+      }
+      if (header->magic.load(std::memory_order_acquire) != MAGIC ||
+        sizeof(Header) + header->capacity * sizeof(Slot) > bytes) {
+        munmap(p, bytes);
+        header = NULL;
+        return false;
+      }
+    }
+    this->name = name;
+    header->attached++;
+    return true;
+  }
+
+  /** Detach; the last process to do so removes the segment */
+  void close() {
+    if (!header) return;
+    pid_t self = getpid();
+    header->flusher.compare_exchange_strong(self, 0);
+    if (--header->attached == 0) {
+      shm_unlink(name.c_str());
+    }
+    munmap(header, bytes);
+    header = NULL;
+    slots = NULL;
+  }
+
+  bool isOpen() const { return header != NULL; }
+
+  /** Whether this process created the segment, i.e., it was empty */
+  bool created() const { return fresh; }
+
+  /** Get the slot for the given key, inserting it if needed. Returns NULL when
+  the key is too long or the table is full. */
+  Slot *find(std::string_view key) {
+    if (!header || key.size() >= KEY_SIZE) return NULL;
+
+    uint64_t h = hash(key);
+    size_t capacity = header->capacity;
+    for (size_t i = 0, index = h % capacity; i < capacity;
+      i++, index = (index + 1) % capacity) {
+
+      Slot &slot = slots[index];
+      uint64_t state = slot.state.load(std::memory_order_acquire);
+      if (state == EMPTY) {
+        if (slot.state.compare_exchange_strong(state, CLAIMED)) {
+          memcpy(slot.key, key.data(), key.size());
+          slot.key[key.size()] = 0;
+          slot.state.store(h, std::memory_order_release);
+          header->keys++;
+          return &slot;
+        }
+        // someone else claimed it, see for which key
+      }
+      while (state == CLAIMED) {
+        std::this_thread::yield();
+        state = slot.state.load(std::memory_order_acquire);
+      }
+      if (state == h && key == slot.key) return &slot;
+    }
+    return NULL;
+  }
+
+  /** Call fn for each key and its slot */
+  void forEach(std::function<void(std::string_view key, Slot &slot)> fn) {
+    if (!header) return;
+    for (size_t i = 0; i < header->capacity; i++) {
+      if (slots[i].state.load(std::memory_order_acquire) & READY) {
+        fn(slots[i].key, slots[i]);
+      }
+    }
+  }
+
+  /** Make this process the flusher, unless another live process is. Returns
+  whether this process is the flusher now. */
+  bool claimFlusher() {
+    if (!header) return false;
+    pid_t self = getpid();
+    pid_t current = header->flusher.load();
+    if (current == self) return true;
+    if (current != 0 && (kill(current, 0) == 0 || errno != ESRCH)) {
+      return false;
+    }
+    return header->flusher.compare_exchange_strong(current, self);
+  }
+
+  bool isFlusher() const {
+    return header && header->flusher.load() == getpid();
+  }
+
+  /** Number of processes attached */
+  int processes() const { return header ? header->attached.load() : 0; }
+
+  /** Number of keys; changes whenever one is inserted */
+  size_t size() const { return header ? header->keys.load() : 0; }
+
+  size_t capacity() const { return header ? header->capacity : 0; }
+};
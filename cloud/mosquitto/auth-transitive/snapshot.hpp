@@ -0,0 +1,65 @@
+
+#include <time.h>
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+/* ----------------------------------------------------------------------------
+* Snapshots
+*
+* Read-copy-update for data that is read on every message but changes rarely.
+* Writers build a complete new version and publish it with a single atomic
+* pointer swap; readers just load the pointer, never lock, and always see a
+* complete version. Replaced versions are freed once they have been retired for
+* longer than the grace period, which must exceed the time any reader holds on
+* to a version (one callback).
+*/
+
+template<typename T>
+class Snapshot {
+  std::atomic<const T *> current{nullptr};
+
+  // only used by writers, who serialize on mutex
+  std::mutex mutex;
+  std::vector<std::pair<const T *, time_t>> retired;
+  time_t gracePeriod;
+
+public:
+
+  Snapshot(time_t gracePeriod = 60) : gracePeriod(gracePeriod) {}
+
+  ~Snapshot() {
+    delete current.load();
+    for (auto &r : retired) delete r.first;
+  }
+
+  /** The current version, NULL until the first publish. */
+  const T *get() const {
+    return current.load(std::memory_order_acquire);
+  }
+
+  /** Make next the current version, retire the previous one. */
+  void publish(std::unique_ptr<T> next, time_t now) {
+    std::lock_guard<std::mutex> lock(mutex);
+    const T *previous = current.exchange(next.release(),
+      std::memory_order_acq_rel);
+
+    std::erase_if(retired, [this, now](auto &r) {
+        if (r.second + gracePeriod > now) return false;
+        delete r.first;
+        return true;
+      });
+    if (previous) {
+      retired.push_back({previous, now});
+    }
+  }
+
+  /** Number of retired versions not yet freed */
+  size_t retiredCount() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return retired.size();
+  }
+};
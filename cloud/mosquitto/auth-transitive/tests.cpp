@@ -1,9 +1,76 @@
 #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+#define TRANSITIVE_COUNT_ALLOCS
 #include "doctest.h"
-#include "isAuthorized.hpp"
+// the whole plugin, including all of its headers, to test its callbacks too
+#include "mosquitto_auth_transitive.cpp"
 
 #include <sstream>
+#include <map>
+#include <numeric> // std::accumulate
 
+/* Just enough of the broker for calling the plugin's callbacks */
+
+struct mosquitto {
+  const char *id;
+  const char *username;
+  const char *address;
+};
+
+extern "C" {
+
+const char *mosquitto_client_id(const struct mosquitto *client) {
+  return client->id;
+}
+
+const char *mosquitto_client_username(const struct mosquitto *client) {
+  return client->username;
+}
+
+const char *mosquitto_client_address(const struct mosquitto *client) {
+  return client->address;
+}
+
+char *mosquitto_strdup(const char *s) {
+  return strdup(s);
+}
+
+int mosquitto_broker_publish_copy(const char *clientid, const char *topic,
+  int payloadlen, const void *payload, int qos, bool retain,
+  mosquitto_property *properties) {
+  return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_kick_client_by_clientid(const char *clientid, bool with_will) {
+  return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_callback_register(mosquitto_plugin_id_t *identifier, int event,
+  MOSQ_FUNC_generic_callback cb_func, const void *event_data, void *userdata) {
+  return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_callback_unregister(mosquitto_plugin_id_t *identifier, int event,
+  MOSQ_FUNC_generic_callback cb_func, const void *event_data) {
+  return MOSQ_ERR_SUCCESS;
+}
+
+}
+
+
+/** Given a user's json, payload from JWT verified during basic_auth, and a
+topic, decide whether the policy grants the user access to the given topic.
+*/
+int isAuthorized(std::vector<std::string> topicParts, std::string username,
+  bool readAccess = false, const Policy &policy = authPolicy) {
+
+  std::string topic = topicParts.empty() ? "" : std::accumulate(
+    std::next(topicParts.begin()), topicParts.end(), topicParts[0],
+    [](std::string a, std::string b) { return a + "/" + b; }
+  );
+
+  return grantAuthorized(compileGrant(username), topic, readAccess,
+    std::time(nullptr), policy);
+}
 
 /** Split the given string using the delimiter, return a vector */
 std::vector<std::string> split(const std::string &s, char delim, int max = 100) {
@@ -277,4 +344,951 @@ TEST_CASE("isAuthorized") {
       }
     }
   }
+
+  SUBCASE("subscription filters") {
+    std::vector<std::string> fleetFilter =
+      split("/user1/+/@scope/capName/+/status/#", '/');
+    SUBCASE("") {
+      CHECK( isAuthorized(fleetFilter, simpleFleetPermission.str(), true) );
+    }
+    SUBCASE("") {
+      CHECK( !isAuthorized(fleetFilter, simpleDevPermission.str(), true) );
+    }
+  }
+}
+
+TEST_CASE("UsageLog") {
+
+  std::string path = "/tmp/usageLogTest.log";
+  remove(path.c_str());
+
+  auto replayed = [&](UsageLog &log) {
+    std::map<std::string, int64_t> totals;
+    log.replay([&](const std::string &org, const std::string &cap,
+        int64_t total) { totals[org + "/" + cap] = total; });
+    return totals;
+  };
+
+  {
+    UsageLog log;
+    REQUIRE( log.open(path, 2, 4) );
+    log.reset(202410);
+    log.set("org1", "cap1", 100);
+    log.set("org1", "cap2", 10);
+    log.commit();
+    log.set("org2", "cap1", 5);
+    log.set("org1", "cap1", 150);
+    log.commit();
+
+    SUBCASE("one slot per meter, overwritten in place") {
+      CHECK( log.count() == 3 );
+      for (int i = 0; i < 10; i++) log.set("org1", "cap1", 150 + i);
+      CHECK( log.count() == 3 );
+      CHECK( replayed(log)["org1/cap1"] == 159 );
+    }
+
+    SUBCASE("stops growing at the maximum number of meters") {
+      CHECK( log.set("org3", "cap1", 1) );
+      CHECK( !log.set("org4", "cap1", 1) );
+      CHECK( log.count() == 4 );
+      CHECK( log.set("org1", "cap1", 200) ); // known meters still update
+    }
+  }
+
+  SUBCASE("survives reopening") {
+    UsageLog log;
+    REQUIRE( log.open(path, 2, 4) );
+    CHECK( log.month() == 202410 );
+    auto totals = replayed(log);
+    CHECK( totals.size() == 3 );
+    CHECK( totals["org1/cap1"] == 150 );
+    CHECK( totals["org1/cap2"] == 10 );
+    CHECK( totals["org2/cap1"] == 5 );
+
+    // and replaying again yields the same
+    CHECK( replayed(log) == totals );
+    log.set("org2", "cap1", 6);
+    CHECK( log.count() == 3 );
+  }
+
+  SUBCASE("a torn write keeps the previous total") {
+    {
+      UsageLog log;
+      REQUIRE( log.open(path, 2, 4) );
+      log.set("org1", "cap1", 160);
+    }
+    // tear the record of org1/cap1 just written: its second write, sequence 3
+    FILE *file = fopen(path.c_str(), "r+b");
+    REQUIRE( file );
+    fseek(file, 64 + 128 + 112, SEEK_SET);
+    fputc(0x7f, file);
+    fclose(file);
+
+    UsageLog log;
+    REQUIRE( log.open(path, 2, 4) );
+    CHECK( replayed(log)["org1/cap1"] == 150 );
+  }
+
+  SUBCASE("rejects names that are too long") {
+    UsageLog log;
+    REQUIRE( log.open(path, 2, 4) );
+    CHECK( !UsageLog::fits(std::string(100, 'x'), "cap1") );
+    CHECK( !log.set(std::string(100, 'x'), "cap1", 1) );
+    CHECK( UsageLog::fits("org1", "cap1") );
+  }
+
+  SUBCASE("reset drops all totals") {
+    UsageLog log;
+    REQUIRE( log.open(path, 2, 4) );
+    log.reset(202411);
+    CHECK( log.count() == 0 );
+    CHECK( replayed(log).empty() );
+  }
+
+  remove(path.c_str());
+}
+
+TEST_CASE("UsageExporter") {
+
+  UsageExporter exporter;
+  UsageExporter::Config config;
+  config.host = "localhost";
+  exporter.configure(config);
+
+  time_t minute = 1727740800; // 2024-10-01 00:00:00 UTC
+
+  SUBCASE("aggregates per device and capability until the minute is over") {
+    exporter.record("/org1/dev1/@scope/cap/1.0.0/data", 10, minute);
+    exporter.record("/org1/dev1/@scope/cap/1.0.0/other", 20, minute + 10);
+    exporter.record("/org1/dev2/@scope/cap", 5, minute + 20);
+    CHECK( exporter.queued() == 0 );
+
+    exporter.record("/org1/dev1/@scope/cap/1.0.0/data", 10, minute + 60);
+    CHECK( exporter.queued() == 1 );
+  }
+
+  SUBCASE("only allocates for rows not seen before") {
+    exporter.record("/org1/dev1/@scope/cap/1.0.0/data", 10, minute);
+    AllocCount made = countAllocs([&]() {
+        exporter.record("/org1/dev1/@scope/cap/1.0.0/other", 20, minute + 10);
+      });
+    CHECK( made.allocations == 0 );
+  }
+
+  SUBCASE("ignores topics outside of the capability namespace") {
+    exporter.record("$SYS/broker/uptime", 10, minute);
+    exporter.record("/org1/dev1", 10, minute);
+    exporter.rotate(minute, true);
+    CHECK( exporter.queued() == 0 );
+  }
+
+  SUBCASE("serializes as JSONCompactColumns") {
+    UsageExporter::Rows rows;
+    rows["/org1/dev1/@scope/cap"] = {30, 2};
+    rows["/org1/dev\"2/@scope/cap"] = {5, 1};
+    CHECK( UsageExporter::serialize(rows, minute) ==
+      R"([["org1","org1"],["dev\"2","dev1"],["@scope/cap","@scope/cap"],)"
+      R"(["2024-10-01 00:00:00","2024-10-01 00:00:00"],[5,30],[1,2]])" );
+  }
+}
+
+TEST_CASE("HeavyHitters") {
+
+  HeavyHitters hitters(3);
+  for (int i = 0; i < 1000; i++) {
+    hitters.add("/org/dev" + std::to_string(i % 100), 10);
+  }
+  for (int i = 0; i < 500; i++) hitters.add("/org/chatty", 1);
+  for (int i = 0; i < 20; i++) hitters.add("/org/bulky", 100000);
+
+  SUBCASE("by messages") {
+    auto top = hitters.top(false);
+    REQUIRE( top.size() == 3 );
+    CHECK( top[0].key == "/org/chatty" );
+    CHECK( top[0].messages >= 500 );
+  }
+
+  SUBCASE("by bytes") {
+    auto top = hitters.top(true);
+    REQUIRE( top.size() == 3 );
+    CHECK( top[0].key == "/org/bulky" );
+    CHECK( top[0].bytes >= 2000000 );
+  }
+
+  SUBCASE("updates don't allocate") {
+    AllocCount made = countAllocs([&]() {
+        hitters.add("/org/chatty", 1);
+        hitters.add("/org/newcomer", 10000000);
+      });
+    CHECK( made.allocations == 0 );
+    CHECK( hitters.top(true)[0].key == "/org/newcomer" );
+  }
+
+  SUBCASE("keeps long keys truncated") {
+    std::string key(1000, 'x');
+    for (int i = 0; i < 1000; i++) hitters.add(key, 1);
+    CHECK( hitters.top(false)[0].key == key.substr(0, HeavyHitters::MAX_KEY) );
+  }
+
+  SUBCASE("forgets what slid out of the window") {
+    for (int i = 0; i < HeavyHitters::WINDOWS - 1; i++) hitters.rotate();
+    CHECK( hitters.top(true).size() == 3 );
+    hitters.rotate();
+    CHECK( hitters.top(true).empty() );
+  }
+}
+
+TEST_CASE("quota") {
+
+  QuotaPolicy policy;
+  policy.set("ros-tool", "unpaid", 100);
+
+  SUBCASE("limits only defined capabilities and plans") {
+    CHECK( policy.limit("ros-tool", "unpaid") == 100 );
+    CHECK( policy.limit("ros-tool", "paid") == UNLIMITED );
+    CHECK( policy.limit("webrtc-video", "unpaid") == UNLIMITED );
+  }
+
+  SUBCASE("meter flags when crossing the limit") {
+    meter usage;
+    usage.setLimit(policy.limit("ros-tool", "unpaid"));
+    CHECK( !usage.add(60) );
+    CHECK( !usage.add(40) );
+    CHECK( usage.add(1) );
+    CHECK( usage.overQuota );
+
+    SUBCASE("and when the limit changes") {
+      usage.setLimit(policy.limit("ros-tool", "paid"));
+      CHECK( !usage.overQuota );
+      usage.setLimit(50);
+      CHECK( usage.overQuota );
+    }
+  }
+
+  SUBCASE("rates are shaped per org and capability") {
+    policy.setRate("ros-tool", "unpaid", 100);
+    policy.setRate("*", "unpaid", 1000);
+    CHECK( policy.rate("ros-tool", "paid") == UNLIMITED );
+
+    shaper org, cap;
+    org.setRate(policy.rate("*", "unpaid"), 10);
+    cap.setRate(policy.rate("ros-tool", "unpaid"), 10);
+    CHECK( shape(org, cap, 150, 10) );
+    CHECK( shape(org, cap, 50, 10) );
+    CHECK( !shape(org, cap, 1, 10) );
+    CHECK( cap.dropped == 1 );
+    CHECK( org.tokens == 1800 ); // nothing taken for the dropped message
+
+    // refilled lazily, up to the burst
+    CHECK( shape(org, cap, 100, 11) );
+    CHECK( !shape(org, cap, 1, 11) );
+    CHECK( shape(org, cap, 200, 20) );
+
+    SUBCASE("messages larger than the burst pass when full") {
+      CHECK( shape(org, cap, 500, 30) );
+      CHECK( !shape(org, cap, 1, 31) );
+      CHECK( shape(org, cap, 1, 34) );
+    }
+
+    SUBCASE("unlimited never drops") {
+      shaper unlimited;
+      CHECK( shape(org, unlimited, 2000, 40) );
+      CHECK( !shape(org, unlimited, 1, 40) );
+      CHECK( org.dropped == 1 );
+    }
+  }
+
+  SUBCASE("some message classes are never shaped") {
+    Unshaped unshaped;
+    unshaped.set("_robot-agent  ros-tool/_status ");
+    CHECK( unshaped.size() == 2 );
+    CHECK( unshaped.contains("_robot-agent", "") );
+    CHECK( unshaped.contains("_robot-agent", "anything") );
+    CHECK( unshaped.contains("ros-tool", "_status/cpu") );
+    CHECK( !unshaped.contains("ros-tool", "image") );
+    CHECK( !unshaped.contains("ros", "_status") );
+    CHECK( countAllocs([&]() { unshaped.contains("ros-tool", "image"); })
+      .allocations == 0 );
+    unshaped.set("");
+    CHECK( !unshaped.contains("_robot-agent", "") );
+  }
+
+  SUBCASE("payloads are limited per capability and topic class") {
+    CHECK( policy.maxPayload("ros-tool", "image/raw") == UNLIMITED );
+    policy.setMaxPayload("ros-tool", "*", 1000);
+    policy.setMaxPayload("ros-tool", "image", 100);
+    policy.setMaxPayload("ros-tool", "image/compressed", 500);
+    CHECK( policy.maxPayload("ros-tool", "status") == 1000 );
+    CHECK( policy.maxPayload("ros-tool", "") == 1000 );
+    CHECK( policy.maxPayload("ros-tool", "image/raw") == 100 );
+    CHECK( policy.maxPayload("ros-tool", "image/compressed/1") == 500 );
+    // others get the default, if any
+    CHECK( policy.maxPayload("webrtc-video", "image") == UNLIMITED );
+    policy.setDefaultMaxPayload("*", 2000);
+    policy.setDefaultMaxPayload("image", 500);
+    CHECK( policy.maxPayload("webrtc-video", "status") == 2000 );
+    CHECK( policy.maxPayload("webrtc-video", "image") == 500 );
+    CHECK( policy.maxPayload("ros-tool", "image") == 100 );
+    // ... separate from the org-wide rates
+    policy.setRate("*", "unpaid", 1000);
+    CHECK( policy.maxPayload("webrtc-video", "status") == 2000 );
+  }
+}
+
+TEST_CASE("topicMatches") {
+  CHECK( topicMatches("/user1/dev1/@scope/capName/#", "/user1/dev1/@scope/capName/0.1.2/a") );
+  CHECK( topicMatches("/user1/+/@scope/capName/+/status/#", "/user1/dev2/@scope/capName/1.0.0/status") );
+  CHECK( topicMatches("/user1/+/@scope/capName/+/status/#", "/user1/dev2/@scope/capName/1.0.0/status/x/y") );
+  CHECK( topicMatches("/a/b", "/a/b") );
+  CHECK( topicMatches("/a/+", "/a/") );
+  CHECK( topicMatches("#", "/a/b") );
+
+  CHECK( !topicMatches("/a/b", "/a/b/c") );
+  CHECK( !topicMatches("/a/b/c", "/a/b") );
+  CHECK( !topicMatches("/a/+", "/a/b/c") );
+  CHECK( !topicMatches("/user1/+/@scope/capName/#", "/user2/dev1/@scope/capName/x") );
+  CHECK( !topicMatches("#", "$SYS/broker/uptime") );
+  CHECK( !topicMatches("+/broker/uptime", "$SYS/broker/uptime") );
+  CHECK( topicMatches("$SYS/#", "$SYS/broker/uptime") );
+}
+
+/** Counts live instances, to see when snapshots are freed */
+struct Counted {
+  static inline int live = 0;
+  int value;
+  Counted(int value) : value(value) { live++; }
+  ~Counted() { live--; }
+};
+
+TEST_CASE("Snapshot") {
+  {
+    Snapshot<Counted> snapshot(60);
+    CHECK( snapshot.get() == NULL );
+
+    snapshot.publish(std::make_unique<Counted>(1), 1000);
+    const Counted *first = snapshot.get();
+    CHECK( first->value == 1 );
+
+    snapshot.publish(std::make_unique<Counted>(2), 1010);
+    CHECK( snapshot.get()->value == 2 );
+    // readers may still be using the first one
+    CHECK( first->value == 1 );
+    CHECK( snapshot.retiredCount() == 1 );
+    CHECK( Counted::live == 2 );
+
+    snapshot.publish(std::make_unique<Counted>(3), 1060);
+    CHECK( snapshot.retiredCount() == 2 );
+
+    // only those retired for longer than the grace period are freed
+    snapshot.publish(std::make_unique<Counted>(4), 1070);
+    CHECK( snapshot.retiredCount() == 2 );
+    CHECK( Counted::live == 3 );
+    CHECK( snapshot.get()->value == 4 );
+  }
+  CHECK( Counted::live == 0 );
+}
+
+TEST_CASE("Scheduler") {
+  Scheduler scheduler;
+  time_t start = scheduler.now();
+  int fast = 0, slow = 0;
+  scheduler.every("fast", 1, [&](time_t) { fast++; });
+  scheduler.every("slow", 10, [&](time_t) { slow++; });
+
+  CHECK( scheduler.tick(start, std::chrono::microseconds(1000)) == 0 );
+  CHECK( scheduler.tick(start + 1, std::chrono::microseconds(1000)) == 1 );
+  CHECK( scheduler.tick(start + 1, std::chrono::microseconds(1000)) == 0 );
+  CHECK( scheduler.now() == start + 1 );
+  CHECK( scheduler.tick(start + 10, std::chrono::microseconds(1000)) == 2 );
+  CHECK( fast == 2 );
+  CHECK( slow == 1 );
+
+  SUBCASE("tasks that don't fit the budget run on the next tick") {
+    int busy = 0;
+    for (auto name : {"busy1", "busy2"}) {
+      scheduler.every(name, 1, [&](time_t) {
+          busy++;
+          std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        });
+    }
+    CHECK( scheduler.tick(start + 20, std::chrono::microseconds(1000)) == 3 );
+    CHECK( busy == 1 );
+    CHECK( scheduler.tick(start + 20, std::chrono::microseconds(1000)) == 1 );
+    CHECK( busy == 2 );
+    CHECK( scheduler.tick(start + 20, std::chrono::microseconds(1000)) == 0 );
+    CHECK( fast == 3 );
+    CHECK( slow == 2 );
+  }
+}
+
+TEST_CASE("Worker") {
+  Worker worker;
+  worker.start();
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  bool started = false, release = false;
+  int done = 0;
+
+  CHECK( worker.post("job", [&]() {
+        std::unique_lock<std::mutex> lock(mutex);
+        started = true;
+        cv.notify_one();
+        cv.wait(lock, [&]() { return release; });
+      }, [&]() { done++; }) );
+  // pending until its result has been applied
+  CHECK( !worker.post("job", []() {}) );
+  CHECK( worker.post("", []() {}) );
+
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [&]() { return started; });
+    release = true;
+  }
+  cv.notify_one();
+  // the running job finishes, queued ones are dropped
+  worker.stop();
+
+  CHECK( done == 0 );
+  CHECK( worker.poll() == 1 );
+  CHECK( done == 1 );
+  CHECK( !worker.post("job", []() {}) );
+}
+
+TEST_CASE("Worker pool") {
+  Worker pool;
+  pool.start(2);
+
+  // each job waits for the other, so they need to run concurrently
+  std::mutex mutex;
+  std::condition_variable cv;
+  int arrived = 0;
+  auto job = [&]() {
+    std::unique_lock<std::mutex> lock(mutex);
+    arrived++;
+    cv.notify_all();
+    cv.wait_for(lock, std::chrono::seconds(5), [&]() { return arrived == 2; });
+  };
+  int done = 0;
+  pool.post("", job, [&]() { done++; });
+  pool.post("", job, [&]() { done++; });
+
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    CHECK( cv.wait_for(lock, std::chrono::seconds(5),
+        [&]() { return arrived == 2; }) );
+  }
+  while (done < 2) {
+    pool.poll();
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  CHECK( done == 2 );
+  pool.stop();
+}
+
+TEST_CASE("Admission") {
+  Admission::Config config;
+  config.ipRate = 1;
+  config.ipBurst = 3;
+  config.orgRate = 1;
+  config.orgBurst = 2;
+  config.globalRate = 5;
+  Admission admission;
+  admission.configure(config);
+  time_t now = 1000;
+
+  SUBCASE("per IP") {
+    for (int i = 0; i < 3; i++) {
+      CHECK( admission.admit("1.2.3.4 a", "1.2.3.4", now) == Admission::ADMITTED );
+    }
+    CHECK( admission.admit("1.2.3.4 b", "1.2.3.4", now) == Admission::IP_LIMITED );
+    CHECK( admission.admit("5.6.7.8 a", "5.6.7.8", now) == Admission::ADMITTED );
+    CHECK( admission.admit("1.2.3.4 b", "1.2.3.4", now + 1) == Admission::ADMITTED );
+  }
+
+  SUBCASE("per org") {
+    CHECK( admission.admitOrg("org1", now) == Admission::ADMITTED );
+    CHECK( admission.admitOrg("org1", now) == Admission::ADMITTED );
+    CHECK( admission.admitOrg("org1", now) == Admission::ORG_LIMITED );
+    CHECK( admission.admitOrg("org2", now) == Admission::ADMITTED );
+  }
+
+  SUBCASE("global") {
+    for (int i = 0; i < 5; i++) {
+      std::string ip = "10.0.0." + std::to_string(i);
+      CHECK( admission.admit(ip, ip, now) == Admission::ADMITTED );
+    }
+    CHECK( admission.admit("10.0.0.9", "10.0.0.9", now) == Admission::GLOBAL_LIMITED );
+  }
+
+  SUBCASE("backoff after failures") {
+    admission.result("1.2.3.4 a", false, now);
+    CHECK( admission.admit("1.2.3.4 a", "1.2.3.4", now) == Admission::BACKOFF );
+    CHECK( admission.admit("1.2.3.4 b", "1.2.3.4", now) == Admission::ADMITTED );
+    CHECK( admission.admit("1.2.3.4 a", "1.2.3.4", now + 1) == Admission::ADMITTED );
+
+    admission.result("1.2.3.4 a", false, now + 1);
+    CHECK( admission.admit("1.2.3.4 a", "1.2.3.4", now + 2) == Admission::BACKOFF );
+    CHECK( admission.admit("1.2.3.4 a", "1.2.3.4", now + 3) == Admission::ADMITTED );
+
+    admission.result("1.2.3.4 a", true, now + 3);
+    admission.result("1.2.3.4 a", false, now + 3);
+    CHECK( admission.admit("1.2.3.4 a", "1.2.3.4", now + 4) == Admission::ADMITTED );
+  }
+
+  SUBCASE("prune") {
+    admission.admit("1.2.3.4 a", "1.2.3.4", now);
+    admission.admitOrg("org1", now);
+    admission.result("1.2.3.4 a", false, now);
+    CHECK( admission.size() == 3 );
+    admission.prune(now + 1000);
+    CHECK( admission.size() == 0 );
+  }
+}
+
+TEST_CASE("Arena") {
+  Arena arena(4096);
+  {
+    std::pmr::map<std::pmr::string, time_t, std::less<>> cache(&arena);
+    cache.emplace("/org/device/@scope/cap/1.0.0/a/rather/long/topic/name", 1);
+    CHECK( arena.size() > 0 );
+    CHECK( cache.find("/org/device/@scope/cap/1.0.0/a/rather/long/topic/name")
+      != cache.end() );
+
+    // allocating beyond the budget fails, counting whole chunks taken from
+    // the heap, and leaves the arena usable
+    auto fill = [&]() {
+      for (int i = 0; i < 1000; i++) {
+        cache.emplace("/org/device/@scope/cap/1.0.0/topic/" + std::to_string(i), i);
+      }
+    };
+    CHECK_THROWS_AS(fill(), std::bad_alloc);
+    CHECK( arena.size() <= arena.limit() );
+    CHECK( arena.size() % 1024 == 0 );
+    CHECK_THROWS_AS(fill(), std::bad_alloc);
+
+    // what's freed is reused
+    size_t size = arena.size();
+    cache.clear();
+    CHECK( arena.size() == size );
+    AllocCount made = countAllocs([&]() {
+        cache.emplace("/org/device/@scope/cap/1.0.0/again", 2);
+      });
+    CHECK( made.allocations == 0 );
+    CHECK( arena.size() == size );
+  }
+}
+
+TEST_CASE("SharedCounters") {
+  std::string name = "/transitive-test-" + std::to_string(getpid());
+  SharedCounters a, b;
+  REQUIRE( a.open(name, 64) );
+  REQUIRE( b.open(name, 64) );
+  CHECK( a.created() );
+  CHECK( !b.created() );
+  CHECK( a.processes() == 2 );
+
+  SUBCASE("both see the same slots") {
+    SharedCounters::Slot *slot = a.find("q/org1/ros-tool");
+    REQUIRE( slot != NULL );
+    slot->value += 10;
+    CHECK( b.find("q/org1/ros-tool")->value == 10 );
+    CHECK( b.find("q/org2/ros-tool")->value == 0 );
+    CHECK( a.size() == 2 );
+
+    int count = 0;
+    a.forEach([&](std::string_view, SharedCounters::Slot &) { count++; });
+    CHECK( count == 2 );
+  }
+
+  SUBCASE("the table fills up") {
+    for (int i = 0; i < 64; i++) {
+      CHECK( a.find("key" + std::to_string(i)) != NULL );
+    }
+    CHECK( a.find("one too many") == NULL );
+    CHECK( a.find(std::string(SharedCounters::KEY_SIZE, 'x')) == NULL );
+  }
+
+  SUBCASE("one flusher at a time") {
+    CHECK( a.claimFlusher() );
+    CHECK( a.isFlusher() );
+    CHECK( a.claimFlusher() );
+    a.close();
+    CHECK( !a.isFlusher() );
+    CHECK( b.claimFlusher() );
+  }
+
+  SUBCASE("meters and buckets share their state") {
+    SharedCounters::Slot *total = a.find("q/org1/ros-tool");
+    SharedCounters::Slot *bucket = a.find("r/org1/ros-tool");
+    meter m1, m2;
+    m1.shared = m2.shared = &total->value;
+    m1.setLimit(100);
+    m2.setLimit(100);
+    CHECK( !m1.add(60) );
+    CHECK( m2.add(60) );
+    CHECK( m1.total() == 120 );
+
+    shaper s1, s2, org;
+    s1.setRate(100, 10);
+    s2.setRate(100, 10);
+    s1.share(&bucket->value, &bucket->stamp, 10);
+    s2.share(&bucket->value, &bucket->stamp, 10);
+    CHECK( shape(org, s1, 150, 10) );
+    CHECK( !shape(org, s2, 100, 10) );
+    CHECK( shape(org, s2, 50, 10) );
+    CHECK( shape(org, s1, 100, 11) );
+    CHECK( !shape(org, s2, 1, 11) );
+  }
+}
+
+TEST_CASE("TimerWheel") {
+  TimerWheel timers(1000);
+  std::vector<std::pair<int, time_t>> fired;
+  auto record = [&](int n) {
+    return [&, n]() { fired.push_back({n, timers.now()}); };
+  };
+
+  SUBCASE("fires timers on time, across levels") {
+    timers.schedule(1005, record(1));
+    timers.schedule(1100, record(2));      // level 1
+    timers.schedule(1000 + 5000, record(3)); // level 2
+    timers.schedule(999, record(4));       // past: next second
+    CHECK( timers.size() == 4 );
+
+    CHECK( timers.advance(1001) == 1 );
+    CHECK( timers.advance(1099) == 1 );
+    CHECK( timers.advance(10000) == 2 );
+    REQUIRE( fired.size() == 4 );
+    CHECK( fired[0] == std::pair<int, time_t>{4, 1001} );
+    CHECK( fired[1] == std::pair<int, time_t>{1, 1005} );
+    CHECK( fired[2] == std::pair<int, time_t>{2, 1100} );
+    CHECK( fired[3] == std::pair<int, time_t>{3, 6000} );
+    CHECK( timers.size() == 0 );
+  }
+
+  SUBCASE("cancelled timers don't fire") {
+    TimerWheel::Id id = timers.schedule(1010, record(1));
+    timers.schedule(1010, record(2));
+    CHECK( timers.cancel(id) );
+    CHECK( !timers.cancel(id) );
+    timers.advance(1020);
+    REQUIRE( fired.size() == 1 );
+    CHECK( fired[0].first == 2 );
+  }
+
+  SUBCASE("timers may schedule timers") {
+    timers.schedule(1010, [&]() {
+        timers.schedule(timers.now() + 1, record(1));
+      });
+    timers.advance(1011);
+    REQUIRE( fired.size() == 1 );
+    CHECK( fired[0].second == 1011 );
+  }
+
+  SUBCASE("timers beyond the span wait") {
+    time_t far = 1000 + 300 * 24 * 3600;
+    timers.schedule(far, record(1));
+    timers.advance(far - 1);
+    CHECK( fired.empty() );
+    timers.advance(far);
+    REQUIRE( fired.size() == 1 );
+    CHECK( fired[0].second == far );
+  }
+}
+
+TEST_CASE("topicFrom") {
+  const char *topic = "/org1/dev1/@scope/cap/1.0/sub/topic";
+  CHECK( topicFrom(topic, 0) == topic );
+  CHECK( topicFrom(topic, 6) == "sub/topic" );
+  CHECK( topicFrom(topic, 7) == "topic" );
+  CHECK( topicFrom(topic, 8) == "" );
+  CHECK( topicFrom("/org1/dev1/@scope/cap/1.0/", 6) == "" );
+  CHECK( topicFrom("/org1/dev1/@scope/cap/1.0", 6) == "" );
+}
+
+TEST_CASE("namespaceAuthorized") {
+  CHECK( namespaceAuthorized("org1:dev1", "/org1/dev1/@scope/cap/1.0/a", false) );
+  CHECK( namespaceAuthorized("org1:dev1", "/org1/_fleet/@scope/cap/1.0/a", true) );
+  CHECK( !namespaceAuthorized("org1:dev1", "/org1/_fleet/@scope/cap/1.0/a", false) );
+  CHECK( !namespaceAuthorized("org1:dev1", "/org1/dev2/@scope/cap/1.0/a", true) );
+  CHECK( !namespaceAuthorized("org1:dev1", "/org2/dev1/@scope/cap/1.0/a", true) );
+  CHECK( !namespaceAuthorized("org1:", "/org1/_fleet/@scope/cap/1.0/a", true) );
+  CHECK( !namespaceAuthorized("org1", "/org1/dev1/@scope/cap/1.0/a", true) );
+  CHECK( !namespaceAuthorized("org1:dev1", "/org1/dev1/@scope", true) );
+  CHECK( !namespaceAuthorized("org1:dev1", "org1/dev1/@scope/cap/1.0", true) );
+
+  CHECK( namespaceAuthorized("cap:@scope/cap", "/org1/dev1/@scope/cap/1.0/a", false) );
+  CHECK( namespaceAuthorized("cap:@scope/cap", "/org2/_fleet/@scope/cap", false) );
+  CHECK( !namespaceAuthorized("cap:@scope/cap", "/org1/dev1/@scope/cap2/1.0", true) );
+  CHECK( !namespaceAuthorized("cap:@scope/cap", "/org1/dev1/@other/cap/1.0", true) );
+  CHECK( !namespaceAuthorized("cap:@scope", "/org1/dev1/@scope/cap/1.0", true) );
+}
+
+TEST_CASE("Policy") {
+  Policy policy = Policy::defaults();
+  CHECK( policy.rules() == 9 );
+  CHECK( policy.isPublic("$SYS/broker/uptime") );
+  CHECK( !policy.isPublic("$SYS/broker/clients/total") );
+
+  SUBCASE("defaults grant tokens what the hard-coded rules did") {
+    for (uint16_t bits = 0; bits < 1 << 11; bits++) {
+      auto is = [bits](uint16_t predicate) { return (bits & predicate) != 0; };
+      bool expected = is(VALID) && is(ORG_MATCH) && (
+        (is(DEVICE_MATCH) && (
+            ((is(CAP_MATCH) || is(AGENT_PERMISSION)) && is(TOPIC_ALLOWED))
+            || (is(READ_ACCESS) && is(AGENT_REQUESTED))))
+        || (is(FLEET_PERMISSION) && is(READ_ACCESS) && is(AGENT_REQUESTED)
+          && is(NO_TOPIC_CONSTRAINTS))
+        || (is(FLEET_PERMISSION) && (is(CAP_MATCH) || is(AGENT_PERMISSION))
+          && is(NO_TOPIC_CONSTRAINTS)));
+      CHECK( policy.allows(TOKEN, bits) == expected );
+    }
+  }
+
+  SUBCASE("errors") {
+    CHECK( policy.addRule("user", {"capMatch"}) == "unknown subject: user" );
+    CHECK( policy.addRule("robot", {"capMatch", "typo"})
+      == "unknown predicate: typo" );
+    CHECK( policy.addRule("robot", {"capMatch", "!capMatch"})
+      == "contradicting predicates" );
+    CHECK( policy.rules() == 9 );
+  }
+
+  SUBCASE("custom") {
+    Policy custom;
+    CHECK( custom.addRule("capability", {"capMatch", "!fleetRequested"}) == "" );
+    CHECK( custom.addRule("robot", {"orgMatch", "deviceMatch", "readAccess"})
+      == "" );
+    const char *topic = "/org1/dev1/@scope/cap/1.0/a";
+    CHECK( namespaceAuthorized("cap:@scope/cap", topic, false, custom) );
+    CHECK( !namespaceAuthorized("cap:@scope/cap", "/org1/_fleet/@scope/cap/1.0",
+        true, custom) );
+    CHECK( namespaceAuthorized("org1:dev1", topic, true, custom) );
+    CHECK( !namespaceAuthorized("org1:dev1", topic, false, custom) );
+    CHECK( !namespaceAuthorized("org1:dev1", "/org1/_fleet/@scope/cap/1.0/a",
+        true, custom) );
+    CHECK( !custom.isPublic("$SYS/broker/uptime") );
+  }
+}
+
+TEST_CASE("grantAuthorized") {
+  Grant grant;
+  grant.org = "org1";
+  grant.device = "dev1";
+  grant.capability = "@scope/cap";
+  grant.expires = 1000;
+
+  const char *topic = "/org1/dev1/@scope/cap/1.0/field/sub";
+  CHECK( grantAuthorized(grant, topic, false, 999) );
+  CHECK( !grantAuthorized(grant, topic, false, 1000) );
+  CHECK( !grantAuthorized(grant, "/org2/dev1/@scope/cap/1.0/field", true, 999) );
+  CHECK( !grantAuthorized(grant, "/org1/dev2/@scope/cap/1.0/field", true, 999) );
+  CHECK( !grantAuthorized(grant, "/org1/dev1/@scope/cap2/1.0", true, 999) );
+  CHECK( !grantAuthorized(grant, "/org1/dev1/@scope", true, 999) );
+  CHECK( !grantAuthorized(grant, "org1/dev1/@scope/cap/1.0", true, 999) );
+
+  SUBCASE("robot-agent") {
+    const char *agent = "/org1/dev1/@transitive-robotics/_robot-agent/1.0/status";
+    CHECK( grantAuthorized(grant, agent, true, 999) );
+    CHECK( !grantAuthorized(grant, agent, false, 999) );
+  }
+
+  SUBCASE("topics") {
+    grant.topicConstraints = true;
+    grant.topics = {"other", "field/sub"};
+    CHECK( grantAuthorized(grant, topic, false, 999) );
+    CHECK( grantAuthorized(grant, "/org1/dev1/@scope/cap/1.0/field/sub/#", true, 999) );
+    CHECK( !grantAuthorized(grant, "/org1/dev1/@scope/cap/1.0/field/x", true, 999) );
+    CHECK( !grantAuthorized(grant, "/org1/dev1/@scope/cap/1.0", true, 999) );
+  }
+
+  SUBCASE("fleet") {
+    grant.device = "_fleet";
+    CHECK( grantAuthorized(grant, topic, false, 999) );
+    CHECK( grantAuthorized(grant, "/org1/+/@scope/cap/+/field/#", true, 999) );
+    grant.topicConstraints = true;
+    CHECK( !grantAuthorized(grant, topic, false, 999) );
+  }
+
+  SUBCASE("no org without matching ids") {
+    grant.org = "";
+    CHECK( !grantAuthorized(grant, "//dev1/@scope/cap/1.0/field", true, 999) );
+  }
+}
+
+TEST_CASE("hot paths don't allocate") {
+  REQUIRE( allocsCounted );
+  CHECK( countAllocs([]() {
+      std::string s(100, 'x');
+    }).allocations == 1 );
+
+  const char *topic = "/org1/device1/@transitive-robotics/ros-tool/1.2.3/data/a/long/path";
+
+  SUBCASE("device namespace checks") {
+    bool allowed = false;
+    AllocCount made = countAllocs([&]() {
+        auto levels = topicLevels<5>(topic);
+        allowed = levels[4] == "ros-tool"
+          && namespaceAuthorized("org1:device1", topic, false)
+          && namespaceAuthorized("cap:@transitive-robotics/ros-tool", topic, true);
+      });
+    CHECK( allowed );
+    CHECK( made.allocations == 0 );
+  }
+
+  SUBCASE("payload limits") {
+    QuotaPolicy policy;
+    policy.setMaxPayload("ros-tool", "*", 1000);
+    policy.setMaxPayload("ros-tool", "data/a", 100);
+    long int max = 0;
+    AllocCount made = countAllocs([&]() {
+        auto levels = topicLevels<5>(topic);
+        max = policy.maxPayload(levels[4], topicFrom(topic, 6));
+      });
+    CHECK( max == 100 );
+    CHECK( made.allocations == 0 );
+  }
+
+  SUBCASE("token checks") {
+    Grant grant;
+    grant.org = "org1";
+    grant.device = "device1";
+    grant.capability = "@transitive-robotics/ros-tool";
+    grant.topicConstraints = true;
+    grant.topics = {"data/a"};
+    grant.expires = 1000;
+    bool allowed = false;
+    AllocCount made = countAllocs([&]() {
+        allowed = grantAuthorized(grant, topic, true, 10);
+      });
+    CHECK( allowed );
+    CHECK( made.allocations == 0 );
+  }
+
+  SUBCASE("read metering") {
+    std::map<std::string, meter, std::less<>> meters;
+    meters["ros-tool"].setLimit(1000);
+    meters["ros-tool"].shaping.setRate(1000, 10);
+    shaper org;
+    bool over = true;
+    AllocCount made = countAllocs([&]() {
+        auto levels = topicLevels<5>(topic);
+        meter &m = meters.find(levels[4])->second;
+        over = !shape(org, m.shaping, 100, 10) || m.add(100);
+      });
+    CHECK( !over );
+    CHECK( made.allocations == 0 );
+  }
+
+  SUBCASE("cache hits") {
+    Arena arena(64 * 1024);
+    std::pmr::map<std::pmr::string, time_t, std::less<>> permissions(&arena);
+    permissions.emplace(topic, 10);
+    std::pmr::string filter("/org1/device1/@transitive-robotics/ros-tool/+/data/#",
+      &arena);
+    bool hit = false;
+    AllocCount made = countAllocs([&]() {
+        hit = permissions.find(topic) != permissions.end()
+          && topicMatches(filter, topic);
+      });
+    CHECK( hit );
+    CHECK( made.allocations == 0 );
+  }
+
+  SUBCASE("acl_check reads, with heavy hitters and usage export") {
+    UsageExporter::Config config;
+    config.host = "clickhouse";
+    usageExporter.configure(config);
+
+    struct mosquitto robot{"device1", "org1:device1", "10.0.0.1"};
+    struct mosquitto web{"web1", "{\"id\":\"org1\"}", "10.0.0.2"};
+    Grant grant;
+    grant.org = "org1";
+    grant.device = "device1";
+    grant.capability = "@transitive-robotics/ros-tool";
+    grant.expires = scheduler.now() + 3600;
+    get_connection(&web, web.id, web.username).grant =
+      std::make_shared<const Grant>(grant);
+
+    mosquitto_evt_acl_check ed{};
+    ed.topic = topic;
+    ed.access = MOSQ_ACL_READ;
+    ed.payloadlen = 100;
+    int results[2] = {-1, -1};
+    auto check = [&]() {
+        ed.client = &robot;
+        results[0] = acl_check<ANY_LISTENER>(&ed);
+        ed.client = &web;
+        results[1] = acl_check<ANY_LISTENER>(&ed);
+      };
+    // the first time adds meters, heavy hitters, export rows, and cache entries
+    check();
+    AllocCount made = countAllocs(check);
+    CHECK( results[0] == MOSQ_ERR_SUCCESS );
+    CHECK( results[1] == MOSQ_ERR_SUCCESS );
+    CHECK( made.allocations == 0 );
+
+    remove_connection(&web);
+    usageExporter.configure({});
+  }
+}
+
+TEST_CASE("usage summaries") {
+  struct mosquitto robot{"device3", "org3:device3", "10.0.0.4"};
+  mosquitto_evt_acl_check ed{};
+  ed.client = &robot;
+  ed.access = MOSQ_ACL_READ;
+  ed.payloadlen = 100;
+  ed.topic = "/org3/device3/@transitive-robotics/ros-tool/1.2.3/data";
+  acl_check<ANY_LISTENER>(&ed);
+
+  publishUsage();
+  org_usage &u = usage.find("org3")->second;
+  CHECK( u.published != 0 );
+  CHECK( usageSignature(u) == u.published );
+
+  // delivering the summary doesn't change it
+  size_t meters = u.cap_usage.size();
+  ed.topic = "/org3" USAGE_TOPIC;
+  ed.payloadlen = 200;
+  acl_check<ANY_LISTENER>(&ed);
+  CHECK( u.cap_usage.size() == meters );
+  CHECK( usageSignature(u) == u.published );
+
+  CHECK( isUsageSummary("/org3" USAGE_TOPIC) );
+  CHECK( !isUsageSummary("/org3/_fleet/" AGENT_CAP "/_usage/more") );
+  CHECK( !isUsageSummary("/org3/device3/" AGENT_CAP "/_usage") );
+}
+
+TEST_CASE("write budget") {
+  long int rate = clientWriteRate;
+  clientWriteRate = 1000;
+  struct mosquitto web{"web2", "{\"id\":\"org1\"}", "10.0.0.3"};
+  client_struct &client = get_connection(&web, web.id, web.username);
+  Grant grant;
+  grant.org = "org1";
+  grant.device = "device1";
+  grant.capability = "@transitive-robotics/ros-tool";
+  grant.expires = scheduler.now() + 3600;
+  client.grant = std::make_shared<const Grant>(grant);
+
+  mosquitto_evt_acl_check ed{};
+  ed.client = &web;
+  ed.access = MOSQ_ACL_WRITE;
+  ed.payloadlen = 1500;
+
+  // denied publishes don't use up the budget
+  ed.topic = "/org2/device1/@transitive-robotics/ros-tool/1.2.3/data";
+  CHECK( acl_check<WEBSOCKET_LISTENER>(&ed) == MOSQ_ERR_ACL_DENIED );
+  CHECK( client.writeBudget.dropped == 0 );
+
+  // authorized ones do, from the cache too
+  ed.topic = "/org1/device1/@transitive-robotics/ros-tool/1.2.3/data";
+  CHECK( acl_check<WEBSOCKET_LISTENER>(&ed) == MOSQ_ERR_SUCCESS );
+  CHECK( acl_check<WEBSOCKET_LISTENER>(&ed) == MOSQ_ERR_ACL_DENIED );
+  CHECK( client.writeBudget.dropped == 1 );
+
+  remove_connection(&web);
+  clientWriteRate = rate;
 }
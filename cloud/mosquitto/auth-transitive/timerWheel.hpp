@@ -0,0 +1,134 @@
+
+#include <time.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/* ----------------------------------------------------------------------------
+* Timers
+*
+* A hierarchical timer wheel with a resolution of one second: four levels of 64
+* slots each, covering 64 seconds, ~68 minutes, ~3 days, and ~194 days. Timers
+* further out wait in the last level and get re-placed when it comes around.
+* Scheduling, cancelling, and firing are O(1); a timer only moves down a level
+* when its slot in the level above comes due, at most three times.
+*
+* Cancelled timers are only forgotten here and dropped from their slot when it
+* comes due. Not thread-safe: use from the broker thread.
+*/
+
+class TimerWheel {
+
+public:
+  typedef uint64_t Id;
+
+private:
+  static const int BITS = 6;
+  static const int SLOTS = 1 << BITS;
+  static const int LEVELS = 4;
+  static const time_t SPAN = time_t(1) << (BITS * LEVELS);
+
+  struct Timer {
+    time_t when;
+    std::function<void()> fire;
+  };
+
+  std::vector<Id> wheels[LEVELS][SLOTS];
+  std::unordered_map<Id, Timer> timers;
+  Id lastId = 0;
+  time_t current;
+
+  /** Put the timer into the slot for when, relative to current */
+  void place(Id id, time_t when) {
+    time_t delta = when - current;
+    if (delta >= SPAN) {
+      when = current + SPAN - 1; // re-placed later
+      delta = SPAN - 1;
+    }
+    int level = 0;
+    while (level < LEVELS - 1 && delta >= time_t(1) << (BITS * (level + 1))) {
+      level++;
+    }
+    wheels[level][(when >> (BITS * level)) & (SLOTS - 1)].push_back(id);
+  }
+
+  /** Move the timers of the given slot down to where they belong now */
+  void cascade(int level, int slot) {
+    std::vector<Id> ids;
+    ids.swap(wheels[level][slot]);
+    for (Id id : ids) {
+      auto it = timers.find(id);
+      if (it != timers.end()) place(id, it->second.when);
+    }
+  }
+
+  /** Advance the clock by one second and fire the timers due then */
+  int step() {
+    current++;
+    // from the top, so timers cascading down two levels land in time
+    int top = 0;
+    while (top < LEVELS - 1
+      && (current & ((time_t(1) << (BITS * (top + 1))) - 1)) == 0) {
+      top++;
+    }
+    for (int level = top; level > 0; level--) {
+      cascade(level, (current >> (BITS * level)) & (SLOTS - 1));
+    }
+
+    std::vector<Id> ids;
+    ids.swap(wheels[0][current & (SLOTS - 1)]);
+    int fired = 0;
+    for (Id id : ids) {
+      auto it = timers.find(id);
+      if (it == timers.end()) continue; // cancelled
+      if (it->second.when > current) {
+        place(id, it->second.when); // was beyond the span
+        continue;
+      }
+      // the timer may schedule or cancel others, including itself
+      std::function<void()> fire = std::move(it->second.fire);
+      timers.erase(it);
+      fire();
+      fired++;
+    }
+    return fired;
+  }
+
+public:
+
+  TimerWheel(time_t now = time(NULL)) : current(now) {}
+
+  /** Call fire at (or the first advance after) the given time. Returns an id
+  for cancelling it. */
+  Id schedule(time_t when, std::function<void()> fire) {
+    Id id = ++lastId;
+    when = std::max(when, current + 1);
+    timers.emplace(id, Timer{when, std::move(fire)});
+    place(id, when);
+    return id;
+  }
+
+  /** Cancel the given timer; returns whether it was still pending */
+  bool cancel(Id id) {
+    return timers.erase(id) > 0;
+  }
+
+  /** Advance the clock to now, firing all timers due by then, in order of
+  their time. Returns the number fired. */
+  int advance(time_t now) {
+    int fired = 0;
+    while (current < now) {
+      fired += step();
+    }
+    return fired;
+  }
+
+  /** Number of pending timers */
+  size_t size() const { return timers.size(); }
+
+  time_t now() const { return current; }
+};
@@ -0,0 +1,63 @@
+
+#include <algorithm>
+#include <array>
+#include <string_view>
+
+/* -------------------------------------------------------------------------- */
+
+/** Whether the given topic matches the subscription filter, following the MQTT
+rules for `+` and `#` wildcards. Does not allocate. */
+inline bool topicMatches(std::string_view filter, std::string_view topic) {
+  // wildcards at the start never match topics starting with $, like $SYS
+  if (!topic.empty() && topic[0] == '$'
+    && !filter.empty() && (filter[0] == '+' || filter[0] == '#')) {
+    return false;
+  }
+
+  size_t f = 0, t = 0;
+  while (true) {
+    size_t fEnd = std::min(filter.find('/', f), filter.size());
+    std::string_view level = filter.substr(f, fEnd - f);
+    if (level == "#") return true;
+
+    size_t tEnd = std::min(topic.find('/', t), topic.size());
+    if (level != "+" && level != topic.substr(t, tEnd - t)) return false;
+
+    bool filterDone = fEnd == filter.size();
+    bool topicDone = tEnd == topic.size();
+    if (filterDone || topicDone) {
+      // "a/#" also matches "a"
+      return (filterDone && topicDone) ||
+        (topicDone && filter.substr(fEnd + 1) == "#");
+    }
+    f = fEnd + 1;
+    t = tEnd + 1;
+  }
+}
+
+/** The first N levels of topic, as views into it; levels the topic doesn't
+have are empty. Does not allocate. */
+template<size_t N>
+std::array<std::string_view, N> topicLevels(std::string_view topic) {
+  std::array<std::string_view, N> levels;
+  size_t start = 0;
+  for (size_t i = 0; i < N && start <= topic.size(); i++) {
+    size_t end = std::min(topic.find('/', start), topic.size());
+    levels[i] = topic.substr(start, end - start);
+    start = end + 1;
+  }
+  return levels;
+}
+
+/** The rest of topic from the given level on, e.g., level 6 of
+/org/device/@scope/name/version/sub/topic is sub/topic; empty if it has fewer
+levels. Does not allocate. */
+inline std::string_view topicFrom(std::string_view topic, size_t level) {
+  size_t start = 0;
+  for (size_t i = 0; i < level; i++) {
+    size_t slash = topic.find('/', start);
+    if (slash == std::string_view::npos) return {};
+    start = slash + 1;
+  }
+  return topic.substr(start);
+}
@@ -0,0 +1,308 @@
+
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <functional>
+#include <map>
+#include <utility>
+#include <vector>
+
+/* ----------------------------------------------------------------------------
+* Usage log
+*
+* Memory-mapped log of this month's metered totals, one slot per org and
+* capability that is overwritten in place, so the log only grows with the
+* number of meters, up to a cap, however often they change. Records copied
+* into the mapping are in the page cache right away, so they survive a crash or
+* restart of the broker process. On init, the totals are replayed into the
+* counters; since they are totals rather than deltas, replaying them on top of
+* what Mongo has is idempotent.
+*
+* Each meter has two slots that are written alternately, with a sequence
+* number, so a write torn by a crash leaves the previous total intact.
+*
+* Not thread-safe: callers serialize access.
+*/
+
+/** A month as a single comparable number, e.g., 202410 for October 2024 */
+inline int usageMonth(time_t time) {
+  struct tm tm;
+  localtime_r(&time, &tm);
+  return (tm.tm_year + 1900) * 100 + tm.tm_mon + 1;
+}
+
+class UsageLog {
+
+  static const uint32_t MAGIC = 0x31555254; // "TRU1"
+  static const uint32_t VERSION = 2;
+
+  struct Header {
+    uint32_t magic;
+    uint32_t version;
+    int32_t month;     // the month the logged totals belong to, see usageMonth
+    uint32_t meters;   // slot pairs in use, written after their first record
+    uint8_t padding[48];
+  };
+
+  struct Record {
+    char org[48];
+    char capability[64];
+    int64_t total;
+    uint32_t sequence; // the higher valid one of a meter's two slots is current
+    uint32_t checksum; // over all preceding bytes of the record
+  };
+
+  static_assert(sizeof(Header) == 64);
+  static_assert(sizeof(Record) == 128);
+
+  int fd = -1;
+  char *data = NULL;
+  size_t size = 0;
+  uint32_t maxMeters = 0;
+  bool full = false; // whether we said so already, see set
+
+  /** Orders (org, capability) pairs of strings and string_views alike */
+  struct keyLess {
+    using is_transparent = void;
+    template<typename A, typename B>
+    bool operator()(const A &a, const B &b) const {
+      int c = std::string_view(a.first).compare(b.first);
+      return c < 0 || (c == 0 && std::string_view(a.second) < b.second);
+    }
+  };
+
+  // the meter of each org and capability, and the sequence of its current slot
+  std::map<std::pair<std::string, std::string>, uint32_t, keyLess> index;
+  std::vector<uint32_t> sequences;
+  // slots written since the last commit
+  uint32_t dirtyFrom = UINT32_MAX, dirtyTo = 0;
+
+  Header *header() const { return (Header *)data; }
+  Record *records() const { return (Record *)(data + sizeof(Header)); }
+  uint32_t capacity() const {
+    return (size - sizeof(Header)) / sizeof(Record) / 2;
+  }
+
+  /** FNV-1a, used to detect torn records */
+  static uint32_t checksum(const Record &r) {
+    uint32_t hash = 2166136261u;
+    const unsigned char *p = (const unsigned char *)&r;
+    for (size_t i = 0; i < offsetof(Record, checksum); i++) {
+      hash = (hash ^ p[i]) * 16777619u;
+    }
+    return hash;
+  }
+
+  static bool valid(const Record &r) {
+    return r.checksum == checksum(r);
+  }
+
+  /** The current record of the given meter, NULL if neither slot is valid */
+  const Record *current(uint32_t meter) const {
+    const Record &a = records()[2 * meter];
+    const Record &b = records()[2 * meter + 1];
+    if (valid(a) && (!valid(b) || a.sequence > b.sequence)) return &a;
+    return valid(b) ? &b : NULL;
+  }
+
+  void write(uint32_t slot, const Record &from) {
+    Record &r = records()[slot];
+    r = from;
+    r.checksum = checksum(r);
+    dirtyFrom = std::min(dirtyFrom, slot);
+    dirtyTo = std::max(dirtyTo, slot + 1);
+  }
+
+  /** (Re-)map the file with room for the given number of meters */
+  bool map(uint32_t meters) {
+    size_t newSize = sizeof(Header) + (size_t)meters * 2 * sizeof(Record);
+    if (data) {
+      munmap(data, size);
+      data = NULL;
+    }
+    if (ftruncate(fd, newSize) != 0) {
+      perror("UsageLog: ftruncate");
+      return false;
+    }
+    void *mapped = mmap(NULL, newSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapped == MAP_FAILED) {
+      perror("UsageLog: mmap");
+      return false;
+    }
+    data = (char *)mapped;
+    size = newSize;
+    return true;
+  }
+
+public:
+
+  ~UsageLog() {
+    close();
+  }
+
+  bool isOpen() const { return data != NULL; }
+
+  /** Open (or create) the log at the given path, with room for the given
+  number of meters, growing up to maxMeters. */
+  bool open(const std::string &path, uint32_t meters = 1024,
+    uint32_t maxMeters = 1 << 16) {
+
+    this->maxMeters = std::max(meters, maxMeters);
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+      perror(("UsageLog: open " + path).c_str());
+      return false;
+    }
+
+    struct stat st;
+    fstat(fd, &st);
+    bool exists = (size_t)st.st_size >= sizeof(Header);
+    uint32_t existing = exists ?
+      (st.st_size - sizeof(Header)) / sizeof(Record) / 2 : 0;
+
+    if (!map(std::max(meters, existing))) {
+      close();
+      return false;
+    }
+
+    if (!exists || header()->magic != MAGIC || header()->version != VERSION
+      || header()->meters > capacity()) {
+      if (exists) {
+        printf("UsageLog: %s is not a valid usage log, discarding\n",
+          path.c_str());
+      }
+      reset(0);
+    }
+
+    // index the meters in the log
+    index.clear();
+    sequences.assign(header()->meters, 0);
+    for (uint32_t i = 0; i < header()->meters; i++) {
+      const Record *r = current(i);
+      if (!r) continue; // torn before it was first written completely
+      index.emplace(std::make_pair(
+          std::string(r->org, strnlen(r->org, sizeof(r->org))),
+          std::string(r->capability, strnlen(r->capability, sizeof(r->capability)))),
+        i);
+      sequences[i] = r->sequence;
+    }
+    return true;
+  }
+
+  void close() {
+    if (data) {
+      msync(data, size, MS_SYNC);
+      munmap(data, size);
+      data = NULL;
+    }
+    if (fd >= 0) {
+      ::close(fd);
+      fd = -1;
+    }
+  }
+
+  int month() const { return header()->month; }
+
+  /** Number of meters in the log */
+  uint32_t count() const { return header()->meters; }
+
+  /** Drop all totals and start logging for the given month. */
+  void reset(int month) {
+    Header *h = header();
+    memset(h, 0, sizeof(Header));
+    h->magic = MAGIC;
+    h->version = VERSION;
+    h->month = month;
+    index.clear();
+    sequences.clear();
+    full = false;
+    msync(data, sizeof(Header), MS_ASYNC);
+  }
+
+  /** Whether usage of the given org and capability can be logged, i.e., their
+  names fit into a record */
+  static bool fits(std::string_view org, std::string_view capability) {
+    return org.size() < sizeof(Record::org)
+      && capability.size() < sizeof(Record::capability);
+  }
+
+  /** Set the total of the given org and capability. It is written back on the
+  next `commit`. Fails for names that don't fit, see `fits`, and for new
+  meters once the log holds maxMeters, which it reports once. */
+  bool set(std::string_view org, std::string_view capability, int64_t total) {
+    if (!fits(org, capability)) return false;
+
+    auto it = index.find(std::make_pair(org, capability));
+    uint32_t meter;
+    if (it != index.end()) {
+      meter = it->second;
+    } else {
+      meter = header()->meters;
+      if (meter >= maxMeters) {
+        if (!full) {
+          printf("UsageLog: full with %u meters, recording further ones in "
+            "Mongo only\n", meter);
+          full = true;
+        }
+        return false;
+      }
+      if (meter >= capacity()
+        && !map(std::min(capacity() * 2, maxMeters))) {
+        return false;
+      }
+      // the other slot may hold anything, e.g., from last month
+      memset(&records()[2 * meter + 1], 0, sizeof(Record));
+      index.emplace(std::make_pair(std::string(org), std::string(capability)),
+        meter);
+      sequences.push_back(0);
+    }
+
+    Record r;
+    memset(&r, 0, sizeof(Record));
+    memcpy(r.org, org.data(), org.size());
+    memcpy(r.capability, capability.data(), capability.size());
+    r.total = total;
+    r.sequence = ++sequences[meter];
+    write(2 * meter + r.sequence % 2, r);
+    if (meter == header()->meters) {
+      // record before the count that covers it
+      std::atomic_signal_fence(std::memory_order_seq_cst);
+      header()->meters = meter + 1;
+      std::atomic_signal_fence(std::memory_order_seq_cst);
+    }
+    return true;
+  }
+
+  /** Schedule the write-back to disk of everything set since the last
+  commit. */
+  void commit() {
+    if (dirtyFrom >= dirtyTo) return;
+    size_t from = (sizeof(Header) + (size_t)dirtyFrom * sizeof(Record))
+      & ~(size_t)4095;
+    size_t to = sizeof(Header) + (size_t)dirtyTo * sizeof(Record);
+    msync(data + from, to - from, MS_ASYNC);
+    msync(data, sizeof(Header), MS_ASYNC);
+    dirtyFrom = UINT32_MAX;
+    dirtyTo = 0;
+  }
+
+  /** Call func with the total of each meter in the log. */
+  void replay(std::function<void(const std::string &org,
+      const std::string &capability, int64_t total)> func) const {
+
+    for (auto &[key, meter] : index) {
+      func(key.first, key.second, current(meter)->total);
+    }
+  }
+};